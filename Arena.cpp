@@ -0,0 +1,40 @@
+#include <algorithm>
+
+#include "Arena.h"
+
+Arena::Arena(size_t blockSize) : blockSize(blockSize), position(nullptr), remaining(0) { }
+
+Arena::~Arena() {
+    clear();
+}
+
+void *Arena::allocate(size_t size, size_t alignment) {
+    size_t padding = (alignment - reinterpret_cast<size_t>(position) % alignment) % alignment;
+    if (position == nullptr || padding + size > remaining) {
+        // objects larger than a block get a block of their own
+        size_t newBlockSize = std::max(blockSize, size);
+        blocks.emplace_back(new char[newBlockSize]);
+        position = blocks.back().get();
+        remaining = newBlockSize;
+        padding = 0;
+        ++stats.blocksCount;
+        stats.bytesReserved += newBlockSize;
+    }
+
+    void *memory = position + padding;
+    position += padding + size;
+    remaining -= padding + size;
+    stats.bytesUsed += size;
+    return memory;
+}
+
+void Arena::clear() {
+    for (auto destructor = destructors.rbegin(); destructor != destructors.rend(); ++destructor) {
+        destructor->destroy(destructor->object);
+    }
+    destructors.clear();
+    blocks.clear();
+    position = nullptr;
+    remaining = 0;
+    stats = ArenaStats();
+}
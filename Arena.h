@@ -0,0 +1,71 @@
+#ifndef RAYTRACING_ARENA_H
+#define RAYTRACING_ARENA_H
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+struct ArenaStats {
+    ArenaStats() : objectsCount(0), blocksCount(0), bytesUsed(0), bytesReserved(0) { }
+
+    size_t objectsCount;
+    size_t blocksCount;   // heap allocations made by the arena
+    size_t bytesUsed;
+    size_t bytesReserved;
+};
+
+// Bump allocator: objects are placed one after another in large blocks, which are released
+// all together by clear() or the destructor. Destructors are only recorded for the types which aren't
+// trivially destructible. That includes every primitive, as Primitive has a virtual destructor,
+// so the teardown of a scene still makes a call per object.
+class Arena {
+    struct Destructor {
+        void (*destroy)(void *);
+        void *object;
+    };
+
+    size_t blockSize;
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char *position;
+    size_t remaining;
+    std::vector<Destructor> destructors;
+    ArenaStats stats;
+
+    template<class T>
+    static void destroy(void *object) {
+        static_cast<T *>(object)->~T();
+    }
+
+    void *allocate(size_t size, size_t alignment);
+
+public:
+    explicit Arena(size_t blockSize = 64 * 1024);
+
+    ~Arena();
+
+    Arena(const Arena &) = delete;
+
+    Arena &operator=(const Arena &) = delete;
+
+    template<class T, class... Args>
+    T *create(Args &&... args) {
+        static_assert(alignof(T) <= alignof(std::max_align_t), "over-aligned types are not supported");
+        T *object = new(allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if (!std::is_trivially_destructible<T>::value) {
+            destructors.push_back(Destructor{&destroy<T>, object});
+        }
+        ++stats.objectsCount;
+        return object;
+    }
+
+    // destroys the objects in the reverse order of creation and frees the blocks
+    void clear();
+
+    const ArenaStats &getStats() const { return stats; }
+};
+
+
+#endif //RAYTRACING_ARENA_H
@@ -0,0 +1,41 @@
+#include <chrono>
+#include <cmath>
+#include <future>
+#include <memory>
+
+#include "BatchRender.h"
+
+void BatchRender::render(const Scene &scene, const std::vector<Screen> &screens, int height, int width,
+                         const FrameHandler &handleFrame, const RenderSettings &settings) {
+    // at most two frames are kept: the one being handled and the one being traced
+    std::unique_ptr<Render> handledFrame;
+    std::future<void> handling;
+
+    for (size_t frame = 0; frame < screens.size(); ++frame) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::unique_ptr<Render> render(new Render(&scene, screens[frame], height, width, settings));
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (handling.valid()) {
+            handling.get();
+        }
+        handledFrame = std::move(render);
+        const Render *frameRender = handledFrame.get();
+        handling = std::async(std::launch::async, [&handleFrame, frame, frameRender, seconds] {
+            handleFrame(frame, *frameRender, seconds);
+        });
+    }
+
+    if (handling.valid()) {
+        handling.get();
+    }
+}
+
+std::vector<Screen> BatchRender::makeTurntable(const Screen &screen, const Point &center, const Vector &axis,
+                                               int framesCount) {
+    std::vector<Screen> screens;
+    for (int frame = 0; frame < framesCount; ++frame) {
+        screens.push_back(screen.rotate(center, axis, 2 * std::acos(-1.0) * frame / framesCount));
+    }
+    return screens;
+}
@@ -0,0 +1,26 @@
+#ifndef RAYTRACING_BATCHRENDER_H
+#define RAYTRACING_BATCHRENDER_H
+
+#include <functional>
+#include <vector>
+
+#include "Render.h"
+
+// Several views of one built scene. The frames are traced one after another, and every finished frame
+// is passed to the frame handler on another thread while the next one is traced.
+class BatchRender {
+public:
+    // called for the frames in order and never for two frames at once, seconds is the tracing time
+    typedef std::function<void(size_t frame, const Render &render, double seconds)> FrameHandler;
+
+    // exceptions thrown by the handler are rethrown after the frames being processed are finished
+    static void render(const Scene &scene, const std::vector<Screen> &screens, int height, int width,
+                       const FrameHandler &handleFrame, const RenderSettings &settings = RenderSettings());
+
+    // framesCount views of a full turn of the screen around the axis going through the center
+    static std::vector<Screen> makeTurntable(const Screen &screen, const Point &center, const Vector &axis,
+                                             int framesCount);
+};
+
+
+#endif //RAYTRACING_BATCHRENDER_H
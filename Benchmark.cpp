@@ -0,0 +1,301 @@
+// Renders the bundled models several times and reports the time distributions as JSON,
+// so that runs on different revisions can be compared.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+#include "LoadFromFile.h"
+#include "Render.h"
+#include "Statistics.h"
+
+#ifndef RAYTRACING_MODELS_DIR
+#define RAYTRACING_MODELS_DIR "models"
+#endif
+
+namespace {
+    const char *const defaultModels[] = {"caustest.rt", "coloringtest.rt", "pool.rt", "quad.rt", "simple.rt",
+                                         "spheres.rt", "teapot.stl"};
+
+    struct BenchmarkOptions {
+        BenchmarkOptions() : height(768), width(1024), runsCount(5), warmupRunsCount(1), countStats(false) { }
+
+        std::vector<std::string> models;
+        int height;
+        int width;
+        int runsCount;
+        int warmupRunsCount;
+        bool countStats;
+        RenderSettings renderSettings;
+        std::string jsonPath; // standard output if empty
+    };
+
+    // nearest-rank percentiles of the sorted samples, in milliseconds
+    struct Distribution {
+        explicit Distribution(std::vector<double> samples) {
+            std::sort(samples.begin(), samples.end());
+            auto percentile = [&samples](double fraction) {
+                size_t rank = static_cast<size_t>(fraction * (samples.size() - 1) + 0.5);
+                return samples[rank] * 1000;
+            };
+            min = percentile(0);
+            p10 = percentile(0.1);
+            median = percentile(0.5);
+            p90 = percentile(0.9);
+            max = percentile(1);
+        }
+
+        double min, p10, median, p90, max;
+
+        std::string toJson() const {
+            std::ostringstream json;
+            json << "{\"min\": " << min << ", \"p10\": " << p10 << ", \"median\": " << median <<
+            ", \"p90\": " << p90 << ", \"max\": " << max << "}";
+            return json.str();
+        }
+    };
+
+    struct ModelResult {
+        std::string model;
+        double loadSeconds;
+        std::vector<double> buildSeconds;
+        std::vector<double> renderSeconds;
+        double samplesPerPixel;
+        KDTreeStats treeStats;
+        Statistics::Snapshot stats; // of the measured runs, if they are counted
+    };
+
+    double getSeconds(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Peak resident set size of the process so far, -1 where it is unknown. It never goes down,
+    // so it is only reported once for all the models.
+    long getPeakMemoryKb() {
+#if defined(__APPLE__)
+        struct rusage usage;
+        return getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss / 1024 : -1;
+#elif defined(__unix__)
+        struct rusage usage;
+        return getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : -1;
+#else
+        return -1;
+#endif
+    }
+
+    std::string escapeJson(const std::string &text) {
+        std::string escaped;
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                escaped += '\\';
+            }
+            escaped += c;
+        }
+        return escaped;
+    }
+
+    ModelResult benchmarkModel(const std::string &filePath, const BenchmarkOptions &options) {
+        ModelResult result;
+        result.model = filePath;
+
+        Scene scene;
+        Screen screen;
+        std::chrono::steady_clock::time_point loadStart = std::chrono::steady_clock::now();
+        LoadFromFile::load(filePath, scene, screen);
+        result.loadSeconds = getSeconds(loadStart);
+
+        // the tree cache is off, so every run builds the tree
+        for (int run = 0; run < options.warmupRunsCount + options.runsCount; ++run) {
+            std::chrono::steady_clock::time_point buildStart = std::chrono::steady_clock::now();
+            scene.buildScene();
+            double buildSeconds = getSeconds(buildStart);
+
+            std::chrono::steady_clock::time_point renderStart = std::chrono::steady_clock::now();
+            Render render(&scene, screen, options.height, options.width, options.renderSettings);
+            double renderSeconds = getSeconds(renderStart);
+
+            if (run >= options.warmupRunsCount) {
+                result.buildSeconds.push_back(buildSeconds);
+                result.renderSeconds.push_back(renderSeconds);
+                result.samplesPerPixel = render.getSamplesPerPixel();
+            }
+            else if (run + 1 == options.warmupRunsCount) {
+                Statistics::reset();
+            }
+        }
+
+        result.treeStats = scene.getTreeStats();
+        result.stats = Statistics::getSnapshot();
+        return result;
+    }
+
+    void writeJson(std::ostream &json, const std::vector<ModelResult> &results, const BenchmarkOptions &options) {
+        int threadsCount = options.renderSettings.threadsCount > 0 ? options.renderSettings.threadsCount :
+                           ThreadPool::getHardwareThreadsCount();
+        json << "{\n";
+        json << "  \"precision\": \"" << (sizeof(Real) == sizeof(float) ? "float" : "double") << "\",\n";
+        json << "  \"threads\": " << threadsCount << ",\n";
+        json << "  \"packets\": " << (options.renderSettings.usePackets ? "true" : "false") << ",\n";
+        json << "  \"width\": " << options.width << ",\n";
+        json << "  \"height\": " << options.height << ",\n";
+        json << "  \"runs\": " << options.runsCount << ",\n";
+        json << "  \"warmup_runs\": " << options.warmupRunsCount << ",\n";
+        json << "  \"peak_rss_kb\": " << getPeakMemoryKb() << ",\n";
+        json << "  \"models\": [\n";
+        for (size_t i = 0; i < results.size(); ++i) {
+            const ModelResult &result = results[i];
+            Distribution render(result.renderSeconds);
+            double raysCount = static_cast<double>(options.width) * options.height * result.samplesPerPixel;
+
+            json << "    {\n";
+            json << "      \"model\": \"" << escapeJson(result.model) << "\",\n";
+            json << "      \"load_ms\": " << result.loadSeconds * 1000 << ",\n";
+            json << "      \"build_ms\": " << Distribution(result.buildSeconds).toJson() << ",\n";
+            json << "      \"render_ms\": " << render.toJson() << ",\n";
+            json << "      \"primary_rays_per_second\": " << raysCount / (render.median / 1000) << ",\n";
+            json << "      \"samples_per_pixel\": " << result.samplesPerPixel << ",\n";
+            if (options.countStats) {
+                const uint64_t *counters = result.stats.counters;
+                json << "      \"counters\": {\"primary_rays\": " << counters[Statistics::PrimaryRays] <<
+                ", \"reflection_rays\": " << counters[Statistics::ReflectionRays] << ", \"refraction_rays\": " <<
+                counters[Statistics::RefractionRays] << ", \"shadow_rays\": " << counters[Statistics::ShadowRays] <<
+                ", \"node_visits\": " << counters[Statistics::NodeVisits] << ", \"primitive_tests\": " <<
+                counters[Statistics::PrimitiveTests] << ", \"packet_node_visits\": " <<
+                counters[Statistics::PacketNodeVisits] << ", \"packet_primitive_tests\": " <<
+                counters[Statistics::PacketPrimitiveTests] << ", \"max_ray_depth\": " << result.stats.maxRayDepth <<
+                "},\n";
+            }
+            json << "      \"tree\": {\"nodes\": " << result.treeStats.nodesCount << ", \"leaves\": " <<
+            result.treeStats.leavesCount << ", \"depth\": " << result.treeStats.maxDepth << ", \"primitives\": " <<
+            result.treeStats.primitivesCount << ", \"references\": " << result.treeStats.primitiveReferences <<
+            "}\n";
+            json << "    }" << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        json << "  ]\n";
+        json << "}\n";
+    }
+
+    void printUsage(const char *program) {
+        std::cerr << "usage: " << program << " [options] [scene.rt | model.stl]...\n"
+        "  --runs <count>           measured runs of every model, 5 by default\n"
+        "  --warmup <count>         runs before the measured ones, 1 by default\n"
+        "  --size <width>x<height>  image size, 1024x768 by default\n"
+        "  --threads <count>        rendering threads, all cores by default\n"
+        "  --no-packets             trace every primary ray on its own\n"
+        "  --json <file>            write the results there instead of the standard output\n"
+        "  --antialias <samples>    supersample the pixels at edges with up to <samples> rays, 1 or at least 4\n"
+        "  --stats                  count the rays of the measured runs, this slows them down a bit\n"
+        "Without models the bundled ones are rendered from " RAYTRACING_MODELS_DIR ".\n";
+    }
+
+    bool parseCommandLine(int argc, char *argv[], BenchmarkOptions &options) {
+        for (int i = 1; i < argc; ++i) {
+            std::string argument = argv[i];
+            bool hasValue = i + 1 < argc;
+
+            if (argument == "--runs" && hasValue) {
+                options.runsCount = std::atoi(argv[++i]);
+                if (options.runsCount <= 0) {
+                    return false;
+                }
+            }
+            else if (argument == "--warmup" && hasValue) {
+                options.warmupRunsCount = std::max(std::atoi(argv[++i]), 0);
+            }
+            else if (argument == "--size" && hasValue) {
+                if (std::sscanf(argv[++i], "%dx%d", &options.width, &options.height) != 2 ||
+                    options.width <= 0 || options.height <= 0) {
+                    return false;
+                }
+            }
+            else if (argument == "--threads" && hasValue) {
+                options.renderSettings.threadsCount = std::max(std::atoi(argv[++i]), 0);
+            }
+            else if (argument == "--no-packets") {
+                options.renderSettings.usePackets = false;
+            }
+            else if (argument == "--json" && hasValue) {
+                options.jsonPath = argv[++i];
+            }
+            else if (argument == "--antialias" && hasValue) {
+                options.renderSettings.maxSamples = std::atoi(argv[++i]);
+                // 2 and 3 samples would be rounded down to a 1x1 grid, which turns the anti-aliasing off
+                if (options.renderSettings.maxSamples <= 0 ||
+                    (options.renderSettings.maxSamples > 1 && options.renderSettings.maxSamples < 4)) {
+                    return false;
+                }
+            }
+            else if (argument == "--stats") {
+                options.countStats = true;
+            }
+            else if (argument.compare(0, 2, "--") == 0) {
+                return false;
+            }
+            else {
+                options.models.push_back(argument);
+            }
+        }
+
+        if (options.models.empty()) {
+            for (const char *model : defaultModels) {
+                options.models.push_back(std::string(RAYTRACING_MODELS_DIR) + "/" + model);
+            }
+        }
+        return true;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    BenchmarkOptions options;
+    if (!parseCommandLine(argc, argv, options)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    Statistics::setEnabled(options.countStats);
+
+    std::vector<ModelResult> results;
+    try {
+        for (const std::string &model : options.models) {
+            Statistics::reset();
+            results.push_back(benchmarkModel(model, options));
+
+            const ModelResult &result = results.back();
+            Distribution render(result.renderSeconds);
+            std::cerr << model << ": build " << Distribution(result.buildSeconds).median << " ms, render " <<
+            render.median << " ms (p10 " << render.p10 << ", p90 " << render.p90 << "), " <<
+            options.width * options.height * result.samplesPerPixel / (render.median / 1000) / 1e6 <<
+            " M primary rays/s, " << result.samplesPerPixel << " samples per pixel\n";
+            if (options.countStats) {
+                Statistics::report(std::cerr);
+            }
+        }
+    }
+    catch (const std::runtime_error &error) {
+        std::cerr << error.what() << "\n";
+        return 1;
+    }
+
+    if (options.jsonPath.empty()) {
+        writeJson(std::cout, results, options);
+    }
+    else {
+        std::ofstream json(options.jsonPath);
+        writeJson(json, results, options);
+        if (!json.good()) {
+            std::cerr << "can't write " << options.jsonPath << "\n";
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -1,12 +1,15 @@
-#include "ConvertToQImage.h"
+#include <vector>
 
-ConvertToQImage::ConvertToQImage(Render *render) {
-    qImage = QImage(render->getWidth(), render->getHeight(), QImage::Format_RGB32);
+#include "ConvertToQImage.h"
+#include "ImageWriter.h"
 
-    for (int y = 0; y < render->getHeight(); ++y) {
-        for (int x = 0; x < render->getWidth(); ++x) {
-            qImage.setPixel(x, y, render->getPixel(y, x).toQRgb());
-        }
+ConvertToQImage::ConvertToQImage(const Render *render) {
+    int width = render->getWidth(), height = render->getHeight();
+    std::vector<uint8_t> rgb(3 * static_cast<size_t>(width) * height);
+    for (int y = 0; y < height; ++y) {
+        ImageWriter::convertRow(render->getRow(y), width, &rgb[3 * static_cast<size_t>(y) * width]);
     }
-};
 
+    // the image only wraps the buffer, so it's copied before the buffer is freed
+    qImage = QImage(rgb.data(), width, height, 3 * width, QImage::Format_RGB888).copy();
+};
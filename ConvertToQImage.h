@@ -8,7 +8,7 @@ class ConvertToQImage {
     QImage qImage;
 
 public:
-    ConvertToQImage(Render *render);
+    ConvertToQImage(const Render *render);
 
     QImage getQImage() const {
         return qImage;
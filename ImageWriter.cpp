@@ -0,0 +1,250 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+#include <zlib.h>
+
+#include "ImageWriter.h"
+
+namespace {
+    bool hasExtension(const std::string &filePath, const std::string &extension) {
+        return filePath.size() >= extension.size() &&
+               filePath.compare(filePath.size() - extension.size(), extension.size(), extension) == 0;
+    }
+
+    // the scaled channel is clamped and truncated
+    inline uint8_t toByte(float channel) {
+        return static_cast<uint8_t>(std::min(255.0f, std::max(0.0f, channel * 255)));
+    }
+
+    void appendUint32(std::vector<uint8_t> &data, uint32_t value) {
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            data.push_back(static_cast<uint8_t>(value >> shift));
+        }
+    }
+
+    void appendLittleEndian(std::vector<uint8_t> &data, uint64_t value, int bytesCount) {
+        for (int i = 0; i < bytesCount; ++i) {
+            data.push_back(static_cast<uint8_t>(value >> (8 * i)));
+        }
+    }
+
+    void appendLittleEndian(std::vector<uint8_t> &data, float value) {
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        appendLittleEndian(data, bits, 4);
+    }
+
+    void appendExrAttribute(std::vector<uint8_t> &header, const char *name, const char *type,
+                            const std::vector<uint8_t> &value) {
+        header.insert(header.end(), name, name + std::strlen(name) + 1);
+        header.insert(header.end(), type, type + std::strlen(type) + 1);
+        appendLittleEndian(header, value.size(), 4);
+        header.insert(header.end(), value.begin(), value.end());
+    }
+
+    void writePngChunk(std::ostream &stream, const char *type, const uint8_t *data, size_t size) {
+        std::vector<uint8_t> header;
+        appendUint32(header, size);
+        header.insert(header.end(), type, type + 4);
+
+        uLong crc = crc32(0, reinterpret_cast<const Bytef *>(type), 4);
+        // a null buffer would reset the crc
+        if (size > 0) {
+            crc = crc32(crc, data, size);
+        }
+        std::vector<uint8_t> footer;
+        appendUint32(footer, crc);
+
+        stream.write(reinterpret_cast<const char *>(header.data()), header.size());
+        stream.write(reinterpret_cast<const char *>(data), size);
+        stream.write(reinterpret_cast<const char *>(footer.data()), footer.size());
+    }
+}
+
+// the loop only has independent stores, so it's vectorized with the cost model set in CMakeLists.txt
+void ImageWriter::convertRow(const Pixel *row, int width, uint8_t *rgb) {
+    for (int x = 0; x < width; ++x) {
+        rgb[3 * x] = toByte(row[x].r);
+        rgb[3 * x + 1] = toByte(row[x].g);
+        rgb[3 * x + 2] = toByte(row[x].b);
+    }
+}
+
+// Rows use the Sub filter, which stores the differences with the pixels to the left and suits the smooth
+// shading, and are compressed with the fastest zlib level, as the encoding shouldn't cost as much as the render
+void ImageWriter::writePng(std::ostream &stream, const Render &render, const std::string &filePath) {
+    const int width = render.getWidth(), height = render.getHeight();
+    const uint8_t signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    stream.write(reinterpret_cast<const char *>(signature), sizeof(signature));
+
+    std::vector<uint8_t> header;
+    appendUint32(header, width);
+    appendUint32(header, height);
+    // 8 bits per channel, RGB, deflate, adaptive filters, no interlace
+    header.insert(header.end(), {8, 2, 0, 0, 0});
+    writePngChunk(stream, "IHDR", header.data(), header.size());
+
+    z_stream deflateStream = z_stream();
+    if (deflateInit(&deflateStream, Z_BEST_SPEED) != Z_OK) {
+        throw std::runtime_error("can't compress " + filePath);
+    }
+
+    std::vector<uint8_t> rgb(3 * width);
+    std::vector<uint8_t> filteredRow(1 + 3 * width);
+    std::vector<uint8_t> compressed(1 << 16);
+    filteredRow[0] = 1;
+
+    for (int y = 0; y < height; ++y) {
+        convertRow(render.getRow(y), width, rgb.data());
+        for (int i = 0; i < 3; ++i) {
+            filteredRow[1 + i] = rgb[i];
+        }
+        for (int i = 3; i < 3 * width; ++i) {
+            filteredRow[1 + i] = static_cast<uint8_t>(rgb[i] - rgb[i - 3]);
+        }
+
+        int flush = y + 1 == height ? Z_FINISH : Z_NO_FLUSH;
+        deflateStream.next_in = filteredRow.data();
+        deflateStream.avail_in = filteredRow.size();
+        do {
+            deflateStream.next_out = compressed.data();
+            deflateStream.avail_out = compressed.size();
+            deflate(&deflateStream, flush);
+            size_t compressedSize = compressed.size() - deflateStream.avail_out;
+            if (compressedSize > 0) {
+                writePngChunk(stream, "IDAT", compressed.data(), compressedSize);
+            }
+        } while (deflateStream.avail_out == 0);
+    }
+    deflateEnd(&deflateStream);
+
+    writePngChunk(stream, "IEND", nullptr, 0);
+}
+
+void ImageWriter::writePpm(std::ostream &stream, const Render &render) {
+    const int width = render.getWidth(), height = render.getHeight();
+    stream << "P6\n" << width << " " << height << "\n255\n";
+
+    std::vector<uint8_t> rgb(3 * width);
+    for (int y = 0; y < height; ++y) {
+        convertRow(render.getRow(y), width, rgb.data());
+        stream.write(reinterpret_cast<const char *>(rgb.data()), rgb.size());
+    }
+}
+
+// little-endian floats, the negative scale marks the byte order, the rows go from the bottom
+void ImageWriter::writePfm(std::ostream &stream, const Render &render) {
+    const int width = render.getWidth(), height = render.getHeight();
+    const uint16_t byteOrderMark = 1;
+    bool isLittleEndian = *reinterpret_cast<const uint8_t *>(&byteOrderMark) == 1;
+    stream << "PF\n" << width << " " << height << "\n" << (isLittleEndian ? "-1.0" : "1.0") << "\n";
+
+    std::vector<float> channels(3 * width);
+    for (int y = height - 1; y >= 0; --y) {
+        const Pixel *row = render.getRow(y);
+        for (int x = 0; x < width; ++x) {
+            channels[3 * x] = row[x].r;
+            channels[3 * x + 1] = row[x].g;
+            channels[3 * x + 2] = row[x].b;
+        }
+        stream.write(reinterpret_cast<const char *>(channels.data()), channels.size() * sizeof(float));
+    }
+}
+
+// Single-part scanline file without compression, every line is a chunk with the float B, G and R channels
+void ImageWriter::writeExr(std::ostream &stream, const Render &render) {
+    const int width = render.getWidth(), height = render.getHeight();
+
+    std::vector<uint8_t> header = {0x76, 0x2f, 0x31, 0x01};
+    appendLittleEndian(header, 2, 4);
+
+    std::vector<uint8_t> channels;
+    for (const char *name : {"B", "G", "R"}) {
+        channels.insert(channels.end(), name, name + 2);
+        // float samples, not perceptually linear, no subsampling
+        appendLittleEndian(channels, 2, 4);
+        appendLittleEndian(channels, 0, 4);
+        appendLittleEndian(channels, 1, 4);
+        appendLittleEndian(channels, 1, 4);
+    }
+    channels.push_back(0);
+    appendExrAttribute(header, "channels", "chlist", channels);
+    appendExrAttribute(header, "compression", "compression", {0});
+
+    std::vector<uint8_t> window;
+    for (int corner : {0, 0, width - 1, height - 1}) {
+        appendLittleEndian(window, corner, 4);
+    }
+    appendExrAttribute(header, "dataWindow", "box2i", window);
+    appendExrAttribute(header, "displayWindow", "box2i", window);
+    appendExrAttribute(header, "lineOrder", "lineOrder", {0});
+
+    std::vector<uint8_t> one, center;
+    appendLittleEndian(one, 1.0f);
+    appendLittleEndian(center, 0.0f);
+    appendLittleEndian(center, 0.0f);
+    appendExrAttribute(header, "pixelAspectRatio", "float", one);
+    appendExrAttribute(header, "screenWindowCenter", "v2f", center);
+    appendExrAttribute(header, "screenWindowWidth", "float", one);
+    header.push_back(0);
+
+    // the offsets of the line chunks from the file start
+    uint64_t chunkSize = 8 + 3 * sizeof(float) * static_cast<uint64_t>(width);
+    uint64_t firstChunk = header.size() + 8 * static_cast<uint64_t>(height);
+    for (int y = 0; y < height; ++y) {
+        appendLittleEndian(header, firstChunk + y * chunkSize, 8);
+    }
+    stream.write(reinterpret_cast<const char *>(header.data()), header.size());
+
+    std::vector<uint8_t> chunk;
+    for (int y = 0; y < height; ++y) {
+        const Pixel *row = render.getRow(y);
+        chunk.clear();
+        appendLittleEndian(chunk, y, 4);
+        appendLittleEndian(chunk, chunkSize - 8, 4);
+        for (int x = 0; x < width; ++x) {
+            appendLittleEndian(chunk, row[x].b);
+        }
+        for (int x = 0; x < width; ++x) {
+            appendLittleEndian(chunk, row[x].g);
+        }
+        for (int x = 0; x < width; ++x) {
+            appendLittleEndian(chunk, row[x].r);
+        }
+        stream.write(reinterpret_cast<const char *>(chunk.data()), chunk.size());
+    }
+}
+
+void ImageWriter::write(const std::string &filePath, const Render &render) {
+    bool isPng = hasExtension(filePath, ".png"), isPpm = hasExtension(filePath, ".ppm");
+    bool isExr = hasExtension(filePath, ".exr");
+    if (!isPng && !isPpm && !isExr && !hasExtension(filePath, ".pfm")) {
+        throw std::runtime_error("unknown image format " + filePath);
+    }
+
+    std::ofstream stream(filePath, std::ios::binary | std::ios::trunc);
+    if (!stream.good()) {
+        throw std::runtime_error("can't open " + filePath);
+    }
+
+    if (isPng) {
+        writePng(stream, render, filePath);
+    }
+    else if (isPpm) {
+        writePpm(stream, render);
+    }
+    else if (isExr) {
+        writeExr(stream, render);
+    }
+    else {
+        writePfm(stream, render);
+    }
+
+    stream.flush();
+    if (!stream.good()) {
+        throw std::runtime_error("can't write " + filePath);
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef RAYTRACING_IMAGEWRITER_H
+#define RAYTRACING_IMAGEWRITER_H
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+#include "Render.h"
+
+// Writes the rendered image row by row straight from the float framebuffer. The channels are clamped to [0, 1]
+// and scaled to 8 bits, except for .pfm and .exr, which keep the float values as they were traced.
+class ImageWriter {
+    static void writePng(std::ostream &stream, const Render &render, const std::string &filePath);
+
+    static void writePpm(std::ostream &stream, const Render &render);
+
+    static void writePfm(std::ostream &stream, const Render &render);
+
+    static void writeExr(std::ostream &stream, const Render &render);
+
+public:
+    // 8-bit RGB of the row pixels, rgb must have room for 3 * width bytes
+    static void convertRow(const Pixel *row, int width, uint8_t *rgb);
+
+    // the format is chosen by the extension: .png, .ppm, .pfm or .exr, throws std::runtime_error if it can't be written
+    static void write(const std::string &filePath, const Render &render);
+};
+
+
+#endif //RAYTRACING_IMAGEWRITER_H
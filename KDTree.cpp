@@ -1,135 +1,768 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <typeinfo>
+
 #include "KDTree.h"
+#include "KDTreeCache.h"
+#include "Statistics.h"
+
+namespace {
+    struct SplitEvent {
+        enum Type {
+            END, PLANAR, START
+        };
+
+        Real position;
+        Type type;
 
-void KDTree::buildTree(const std::vector<Primitive *> &primitives) {
-    root = new KDNode(primitives, 0, BoundingBox(
-            Point(-std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity(),
-                  -std::numeric_limits<double>::infinity()),
-            Point(std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity(),
-                  std::numeric_limits<double>::infinity())));
+        SplitEvent(Real position, Type type) : position(position), type(type) { }
+
+        bool operator<(const SplitEvent &event) const {
+            return position < event.position || (position == event.position && type < event.type);
+        }
+    };
 }
 
-bool KDTree::findRayIntersection(const Point &rayStart, const Vector &rayDirection, Intersection &nearestIntersection) {
-    return root->findRayIntersection(rayStart, rayDirection, nearestIntersection);
+const int KDTree::maxTreeDepth;
+
+// State of building a subtree. Subtrees forked to other threads get their own contexts
+// and are appended to the parent arrays when they are finished.
+struct KDTree::BuildContext {
+    BuildContext(const std::vector<BoundingBox> &primitiveBoxes, const KDTreeSettings &settings, int maxDepth,
+                 ThreadPool *pool) :
+            primitiveBoxes(primitiveBoxes), settings(settings), maxDepth(maxDepth), pool(pool) { }
+
+    const std::vector<BoundingBox> &primitiveBoxes;
+    const KDTreeSettings &settings;
+    int maxDepth;
+    ThreadPool *pool;
+
+    std::vector<KDNode> nodes;
+    std::vector<uint32_t> primitiveIndices;
+    KDTreeStats stats;
+
+    // Scratch memory reused by all nodes of the subtree. The primitive lists of the nodes
+    // on the path from the subtree root form a stack, the current node list is on the top.
+    std::vector<uint32_t> primitivesStack;
+    std::vector<BoundingBox> clippedBoxes;
+    std::vector<SplitEvent> events;
+    std::vector<uint8_t> sides;
+};
+
+void KDTree::buildTree(const std::vector<Primitive *> &primitives, const KDTreeSettings &settings) {
+    PhaseTimer timer(Statistics::Build);
+    builtNodes.clear();
+    builtPrimitiveIndices.clear();
+    cacheFile.reset();
+    nodes = nullptr;
+    nodesCount = 0;
+    primitiveIndices = nullptr;
+    stats = KDTreeStats();
+
+    std::vector<BoundingBox> primitiveBoxes;
+    addElements(primitives, primitiveBoxes);
+
+    int maxDepth = settings.maxDepth;
+    if (maxDepth <= 0) {
+        maxDepth = static_cast<int>(8 + 1.3 * std::log2(std::max<size_t>(getElementsCount(), 1)));
+    }
+    maxDepth = std::min(maxDepth, maxTreeDepth);
+
+    sceneBox = BoundingBox(Point(0, 0, 0), Point(0, 0, 0));
+    for (size_t i = 0; i < primitiveBoxes.size(); ++i) {
+        sceneBox.minCorner = i == 0 ? primitiveBoxes[i].minCorner :
+                             BoundingBox::uniteMinCorners(sceneBox.minCorner, primitiveBoxes[i].minCorner);
+        sceneBox.maxCorner = i == 0 ? primitiveBoxes[i].maxCorner :
+                             BoundingBox::uniteMaxCorners(sceneBox.maxCorner, primitiveBoxes[i].maxCorner);
+    }
+
+    // the tree depends only on the element bounds and the settings, so they identify it in the cache
+    uint64_t cacheKey = 0;
+    if (!settings.cacheDirectory.empty()) {
+        cacheKey = KDTreeCache::getKey(primitiveBoxes, settings, maxDepth);
+        if (KDTreeCache::load(*this, settings.cacheDirectory, cacheKey)) {
+            return;
+        }
+    }
+
+    // small scenes are never forked, so they don't start the threads
+    std::unique_ptr<ThreadPool> pool;
+    if (getElementsCount() >= static_cast<size_t>(settings.parallelCutoff)) {
+        int threadsCount = settings.threadsCount > 0 ? settings.threadsCount : ThreadPool::getHardwareThreadsCount();
+        if (threadsCount > 1) {
+            pool.reset(new ThreadPool(threadsCount));
+        }
+    }
+
+    BuildContext context(primitiveBoxes, settings, maxDepth, pool.get());
+    context.primitivesStack.resize(getElementsCount());
+    std::iota(context.primitivesStack.begin(), context.primitivesStack.end(), 0);
+    buildNode(context, 0, 0, sceneBox);
+
+    builtNodes.swap(context.nodes);
+    builtPrimitiveIndices.swap(context.primitiveIndices);
+    nodes = builtNodes.data();
+    nodesCount = builtNodes.size();
+    primitiveIndices = builtPrimitiveIndices.data();
+    stats = context.stats;
+    stats.primitivesCount = getElementsCount();
+
+    // a cache that can't be written only costs the next run a rebuild
+    if (!settings.cacheDirectory.empty()) {
+        KDTreeCache::save(*this, settings.cacheDirectory, cacheKey);
+    }
 }
 
-#ifdef COUNT_STATS
-int KDNode::_buildCalls = 0;
-int KDNode::_findCalls = 0;
-#endif
+// the exact type is checked, as the direct calls would skip the methods overridden by subclasses
+void KDTree::addElements(const std::vector<Primitive *> &primitives, std::vector<BoundingBox> &elementBoxes) {
+    meshTriangles.clear();
+    triangles.clear();
+    spheres.clear();
+    polygons.clear();
+    otherPrimitives.clear();
 
-KDNode::KDNode(const std::vector<Primitive *> &primitives, int iter, const BoundingBox &nodeBox) {
-#ifdef COUNT_STATS
-    ++_buildCalls;
-#endif
-    boundingBox.boundPrimitives(primitives);
-    // intersection of bounding boxes
-    boundingBox.minCorner = BoundingBox::uniteMaxCorners(boundingBox.minCorner, nodeBox.minCorner);
-    boundingBox.maxCorner = BoundingBox::uniteMinCorners(boundingBox.maxCorner, nodeBox.maxCorner);
-
-    if (iter > maxRecursionDepth || primitives.size() < maxObjectsInList) {
-        plane = NONE;
-        left = nullptr;
-        right = nullptr;
-        nodePrimitives = primitives;
-        return;
+    std::vector<const Primitive *> primitivesByType[ElementTypesCount];
+    for (const Primitive *primitive : primitives) {
+        const std::type_info &type = typeid(*primitive);
+        if (type == typeid(TriangleMesh)) {
+            const TriangleMesh *mesh = static_cast<const TriangleMesh *>(primitive);
+            for (size_t i = 0; i < mesh->getTrianglesCount(); ++i) {
+                meshTriangles.push_back({mesh, static_cast<uint32_t>(i)});
+            }
+            primitivesByType[MeshTriangleElement].push_back(primitive);
+        }
+        else if (type == typeid(Triangle)) {
+            triangles.push_back(static_cast<const Triangle *>(primitive));
+            primitivesByType[TriangleElement].push_back(primitive);
+        }
+        else if (type == typeid(Sphere)) {
+            spheres.push_back(static_cast<const Sphere *>(primitive));
+            primitivesByType[SphereElement].push_back(primitive);
+        }
+        else if (type == typeid(Polygon)) {
+            polygons.push_back(static_cast<const Polygon *>(primitive));
+            primitivesByType[PolygonElement].push_back(primitive);
+        }
+        else {
+            // other primitives with several elements can only be intersected as a whole
+            otherPrimitives.push_back(primitive);
+            primitivesByType[OtherElement].push_back(primitive);
+        }
     }
 
-    plane = static_cast<Plane>(iter % 3);
+    for (int type = 0; type < ElementTypesCount; ++type) {
+        for (const Primitive *primitive : primitivesByType[type]) {
+            if (type == MeshTriangleElement) {
+                for (size_t i = 0; i < primitive->getElementsCount(); ++i) {
+                    elementBoxes.push_back(primitive->getElementBoundingBox(i));
+                }
+            }
+            else {
+                elementBoxes.push_back(primitive->getBoundingBox());
+            }
+        }
+        elementTypeEnds[type] = elementBoxes.size();
+    }
+}
+
+template <>
+inline bool KDTree::findHitOfType<KDTree::MeshTriangleElement>(uint32_t element, const Point &rayStart,
+                                                                const Vector &rayDirection, Hit &hit) const {
+    const MeshTriangle &triangle = meshTriangles[element];
+    return triangle.mesh->TriangleMesh::findElementHit(triangle.index, rayStart, rayDirection, hit);
+}
+
+template <>
+inline bool KDTree::findHitOfType<KDTree::TriangleElement>(uint32_t element, const Point &rayStart,
+                                                            const Vector &rayDirection, Hit &hit) const {
+    return triangles[element - elementTypeEnds[MeshTriangleElement]]->Triangle::findHit(rayStart, rayDirection, hit);
+}
+
+template <>
+inline bool KDTree::findHitOfType<KDTree::SphereElement>(uint32_t element, const Point &rayStart,
+                                                          const Vector &rayDirection, Hit &hit) const {
+    return spheres[element - elementTypeEnds[TriangleElement]]->Sphere::findHit(rayStart, rayDirection, hit);
+}
+
+template <>
+inline bool KDTree::findHitOfType<KDTree::PolygonElement>(uint32_t element, const Point &rayStart,
+                                                           const Vector &rayDirection, Hit &hit) const {
+    return polygons[element - elementTypeEnds[SphereElement]]->Polygon::findHit(rayStart, rayDirection, hit);
+}
 
-    Point middlePoint = (boundingBox.minCorner + boundingBox.maxCorner) * 0.5;
-    BoundingBox leftNodeBoundingBox = boundingBox, rightNodeBoundingBox = boundingBox;
+template <>
+inline bool KDTree::findHitOfType<KDTree::OtherElement>(uint32_t element, const Point &rayStart,
+                                                         const Vector &rayDirection, Hit &hit) const {
+    return otherPrimitives[element - elementTypeEnds[PolygonElement]]->findHit(rayStart, rayDirection, hit);
+}
 
-    Vector planeNormal;
-    if (plane == XY) {
-        planeNormal = Vector(0, 0, -1);
-        leftNodeBoundingBox.maxCorner.setZ(middlePoint.getZ());
-        rightNodeBoundingBox.minCorner.setZ(middlePoint.getZ());
+bool KDTree::findHit(uint32_t element, const Point &rayStart, const Vector &rayDirection, Hit &hit) const {
+    if (element < elementTypeEnds[MeshTriangleElement]) {
+        return findHitOfType<MeshTriangleElement>(element, rayStart, rayDirection, hit);
+    }
+    else if (element < elementTypeEnds[TriangleElement]) {
+        return findHitOfType<TriangleElement>(element, rayStart, rayDirection, hit);
+    }
+    else if (element < elementTypeEnds[SphereElement]) {
+        return findHitOfType<SphereElement>(element, rayStart, rayDirection, hit);
     }
-    else if (plane == XZ) {
-        planeNormal = Vector(0, -1, 0);
-        leftNodeBoundingBox.maxCorner.setY(middlePoint.getY());
-        rightNodeBoundingBox.minCorner.setY(middlePoint.getY());
+    else if (element < elementTypeEnds[PolygonElement]) {
+        return findHitOfType<PolygonElement>(element, rayStart, rayDirection, hit);
     }
-    else if (plane == YZ) {
-        planeNormal = Vector(-1, 0, 0);
-        leftNodeBoundingBox.maxCorner.setX(middlePoint.getX());
-        rightNodeBoundingBox.minCorner.setX(middlePoint.getX());
+    else {
+        return findHitOfType<OtherElement>(element, rayStart, rayDirection, hit);
     }
+}
 
-    std::vector<Primitive *> leftNodePrimitives, rightNodePrimitives;
-    dividePrimitives(middlePoint, planeNormal, primitives, leftNodePrimitives, rightNodePrimitives);
+void KDTree::getIntersection(uint32_t element, const Point &rayStart, const Vector &rayDirection, const Hit &hit,
+                             Intersection &intersection) const {
+    // the meshes replace it with the hit triangle
+    intersection.element = 0;
+    if (element < elementTypeEnds[MeshTriangleElement]) {
+        const MeshTriangle &triangle = meshTriangles[element];
+        triangle.mesh->getElementIntersection(triangle.index, rayStart, rayDirection, hit, intersection);
+    }
+    else if (element < elementTypeEnds[TriangleElement]) {
+        triangles[element - elementTypeEnds[MeshTriangleElement]]->getIntersection(rayStart, rayDirection, hit,
+                                                                                   intersection);
+    }
+    else if (element < elementTypeEnds[SphereElement]) {
+        spheres[element - elementTypeEnds[TriangleElement]]->getIntersection(rayStart, rayDirection, hit,
+                                                                             intersection);
+    }
+    else if (element < elementTypeEnds[PolygonElement]) {
+        polygons[element - elementTypeEnds[SphereElement]]->getIntersection(rayStart, rayDirection, hit,
+                                                                            intersection);
+    }
+    else {
+        otherPrimitives[element - elementTypeEnds[PolygonElement]]->getIntersection(rayStart, rayDirection, hit,
+                                                                                    intersection);
+    }
+}
 
-    left = new KDNode(leftNodePrimitives, iter + 1, leftNodeBoundingBox);
-    right = new KDNode(rightNodePrimitives, iter + 1, rightNodeBoundingBox);
+// Tests the elements of the type from the start of the rest of the leaf, handleHit(element, hit) returns true
+// to stop the leaf. Returns false if the leaf was stopped.
+template <KDTree::ElementType type, class HitHandler>
+inline bool KDTree::intersectRun(const uint32_t *&element, const uint32_t *leafEnd, const Point &rayStart,
+                                 const Vector &rayDirection, HitHandler &handleHit) const {
+    for (; element != leafEnd && *element < elementTypeEnds[type]; ++element) {
+        Hit hit;
+        if (findHitOfType<type>(*element, rayStart, rayDirection, hit) && handleHit(*element, hit)) {
+            ++element;
+            return false;
+        }
+    }
+    return true;
 }
 
-void KDNode::dividePrimitives(const Point &middlePoint, const Vector &planeNormal,
-                              const std::vector<Primitive *> &primitives,
-                              std::vector<Primitive *> &leftNodePrimitives,
-                              std::vector<Primitive *> &rightNodePrimitives) {
-    for (Primitive *primitive : primitives) {
-        BoundingBox primitiveBoundingBox = primitive->getBoundingBox();
-        if (Point::doubleGreaterOrEqual((primitiveBoundingBox.minCorner - middlePoint) % planeNormal, 0)) {
-            leftNodePrimitives.push_back(primitive);
+// returns the number of the tested elements
+template <class HitHandler>
+uint32_t KDTree::intersectLeaf(const KDNode *leaf, const Point &rayStart, const Vector &rayDirection,
+                               HitHandler handleHit) const {
+    const uint32_t *leafBegin = primitiveIndices + leaf->getPrimitivesOffset();
+    const uint32_t *leafEnd = leafBegin + leaf->getPrimitivesCount();
+    const uint32_t *element = leafBegin;
+
+    intersectRun<MeshTriangleElement>(element, leafEnd, rayStart, rayDirection, handleHit) &&
+    intersectRun<TriangleElement>(element, leafEnd, rayStart, rayDirection, handleHit) &&
+    intersectRun<SphereElement>(element, leafEnd, rayStart, rayDirection, handleHit) &&
+    intersectRun<PolygonElement>(element, leafEnd, rayStart, rayDirection, handleHit) &&
+    intersectRun<OtherElement>(element, leafEnd, rayStart, rayDirection, handleHit);
+    return element - leafBegin;
+}
+
+// Builds the subtree of the primitives from primitivesBegin to the top of the stack and removes them from it
+void KDTree::buildNode(BuildContext &context, size_t primitivesBegin, int depth, const BoundingBox &nodeBox) {
+    std::vector<uint32_t> &primitivesStack = context.primitivesStack;
+    size_t primitivesCount = primitivesStack.size() - primitivesBegin;
+
+    uint32_t node = context.nodes.size();
+    context.nodes.push_back(KDNode());
+    ++context.stats.nodesCount;
+
+    if (depth >= context.maxDepth || primitivesCount == 0) {
+        makeLeaf(context, node, primitivesBegin, depth);
+        return;
+    }
+
+    // primitive bounds clipped by the node cell
+    context.clippedBoxes.clear();
+    for (size_t i = primitivesBegin; i < primitivesStack.size(); ++i) {
+        const BoundingBox &primitiveBox = context.primitiveBoxes[primitivesStack[i]];
+        context.clippedBoxes.push_back(
+                BoundingBox(BoundingBox::uniteMaxCorners(primitiveBox.minCorner, nodeBox.minCorner),
+                            BoundingBox::uniteMinCorners(primitiveBox.maxCorner, nodeBox.maxCorner)));
+    }
+
+    int splitAxis;
+    Real split;
+    bool planarToLeft;
+    double splitCost = findBestSplit(context, nodeBox, splitAxis, split, planarToLeft);
+    if (splitCost >= context.settings.intersectionCost * primitivesCount) {
+        makeLeaf(context, node, primitivesBegin, depth);
+        return;
+    }
+
+    BoundingBox leftNodeBox = nodeBox, rightNodeBox = nodeBox;
+    leftNodeBox.maxCorner.setCoordinate(splitAxis, split);
+    rightNodeBox.minCorner.setCoordinate(splitAxis, split);
+
+    // 1 for the primitives going to the left child, 2 for the right one, 3 for both
+    std::vector<uint8_t> &sides = context.sides;
+    sides.resize(primitivesCount);
+    size_t rightCount = 0;
+    for (size_t i = 0; i < primitivesCount; ++i) {
+        Real minPosition = context.clippedBoxes[i].minCorner.getCoordinate(splitAxis);
+        Real maxPosition = context.clippedBoxes[i].maxCorner.getCoordinate(splitAxis);
+        if (minPosition == split && maxPosition == split) {
+            sides[i] = planarToLeft ? 1 : 2;
         }
-        if (Point::doubleLessOrEqual((primitiveBoundingBox.maxCorner - middlePoint) % planeNormal, 0)) {
-            rightNodePrimitives.push_back(primitive);
+        else {
+            sides[i] = (minPosition < split ? 1 : 0) | (maxPosition > split ? 2 : 0);
         }
+        rightCount += (sides[i] & 2) != 0;
     }
+
+    // A large right subtree is built by another thread into its own arrays, the left one is continued here.
+    // Otherwise both lists are pushed on the stack, the right one under the left one.
+    bool forkRight = context.pool != nullptr &&
+                     rightCount >= static_cast<size_t>(context.settings.parallelCutoff);
+    std::unique_ptr<BuildContext> rightContext;
+    if (forkRight) {
+        rightContext.reset(new BuildContext(context.primitiveBoxes, context.settings, context.maxDepth,
+                                            context.pool));
+    }
+    std::vector<uint32_t> &rightPrimitives = forkRight ? rightContext->primitivesStack : primitivesStack;
+    size_t rightBegin = rightPrimitives.size();
+    for (size_t i = 0; i < primitivesCount; ++i) {
+        if (sides[i] & 2) {
+            uint32_t primitive = primitivesStack[primitivesBegin + i];
+            rightPrimitives.push_back(primitive);
+        }
+    }
+    size_t leftBegin = primitivesStack.size();
+    for (size_t i = 0; i < primitivesCount; ++i) {
+        if (sides[i] & 1) {
+            uint32_t primitive = primitivesStack[primitivesBegin + i];
+            primitivesStack.push_back(primitive);
+        }
+    }
+
+    TaskGroup rightTask;
+    if (forkRight) {
+        BuildContext *subtree = rightContext.get();
+        context.pool->run(rightTask, [subtree, depth, rightNodeBox] {
+            buildNode(*subtree, 0, depth + 1, rightNodeBox);
+        });
+    }
+
+    // The node keeps the split in single precision. The rounding moves the plane by less than a float ulp,
+    // which can only hide a primitive from rays grazing the plane; the primitives are still divided
+    // by the exact position, so those touching the plane are not duplicated.
+    buildNode(context, leftBegin, depth + 1, leftNodeBox);
+    context.nodes[node].initInner(splitAxis, static_cast<float>(split), context.nodes.size());
+    if (forkRight) {
+        context.pool->wait(rightTask);
+        appendSubtree(context, *rightContext);
+    }
+    else {
+        buildNode(context, rightBegin, depth + 1, rightNodeBox);
+    }
+    primitivesStack.resize(primitivesBegin);
 }
 
-bool KDNode::findRayIntersection(const Point &rayStart, const Vector &rayDirection, Intersection &nearestIntersection) {
-#ifdef COUNT_STATS
-    ++_findCalls;
-#endif
-    if (!boundingBox.intersectsWithRay(rayStart, rayDirection)) { // FIXME
-        return false;
+void KDTree::makeLeaf(BuildContext &context, uint32_t node, size_t primitivesBegin, int depth) {
+    std::vector<uint32_t> &primitivesStack = context.primitivesStack;
+    size_t primitivesCount = primitivesStack.size() - primitivesBegin;
+
+    // the elements of every type form a run in the sorted leaf
+    std::sort(primitivesStack.begin() + primitivesBegin, primitivesStack.end());
+    context.nodes[node].initLeaf(context.primitiveIndices.size(), primitivesCount);
+    context.primitiveIndices.insert(context.primitiveIndices.end(), primitivesStack.begin() + primitivesBegin,
+                                    primitivesStack.end());
+    primitivesStack.resize(primitivesBegin);
+
+    ++context.stats.leavesCount;
+    if (primitivesCount == 0) {
+        ++context.stats.emptyLeavesCount;
+    }
+    context.stats.primitiveReferences += primitivesCount;
+    context.stats.maxDepth = std::max(context.stats.maxDepth, depth);
+}
+
+void KDTree::appendSubtree(BuildContext &context, const BuildContext &subtree) {
+    uint32_t nodesOffset = context.nodes.size();
+    uint32_t primitivesOffset = context.primitiveIndices.size();
+
+    for (KDNode node : subtree.nodes) {
+        node.relocate(nodesOffset, primitivesOffset);
+        context.nodes.push_back(node);
     }
+    context.primitiveIndices.insert(context.primitiveIndices.end(), subtree.primitiveIndices.begin(),
+                                    subtree.primitiveIndices.end());
 
-    nearestIntersection.distance = std::numeric_limits<double>::infinity();
+    context.stats.nodesCount += subtree.stats.nodesCount;
+    context.stats.leavesCount += subtree.stats.leavesCount;
+    context.stats.emptyLeavesCount += subtree.stats.emptyLeavesCount;
+    context.stats.primitiveReferences += subtree.stats.primitiveReferences;
+    context.stats.maxDepth = std::max(context.stats.maxDepth, subtree.stats.maxDepth);
+}
+
+// Front-to-back traversal: the ray interval [tMin, tMax] is clipped by the split planes
+// and only the children crossed by the ray are visited.
+// visitLeaf(leaf, tMax) tests the leaf primitives and returns true when farther cells can't change the result.
+template <class LeafVisitor>
+void KDTree::traverse(const Ray &ray, Real maxT, LeafVisitor visitLeaf) const {
+    Real tMin, tMax;
+    if (nodesCount == 0 || !sceneBox.intersectsWithRay(ray, tMin, tMax)) {
+        return;
+    }
+    tMin = std::max<Real>(tMin, 0);
+    tMax = std::min(tMax, maxT);
+    if (tMin > tMax) {
+        return;
+    }
 
-    if (plane == NONE) {
-        for (Primitive *primitive : nodePrimitives) {
-            Intersection intersection;
+    struct StackEntry {
+        const KDNode *node;
+        Real tMin, tMax;
+    };
+    StackEntry stack[maxTreeDepth];
+    int stackSize = 0;
 
-            if (primitive->intersectWithRay(rayStart, rayDirection, intersection) &&
-                intersection < nearestIntersection) {
-                nearestIntersection = intersection;
+    const KDNode *node = nodes;
+    LocalCounter nodeVisits(Statistics::NodeVisits);
+
+    while (true) {
+        ++nodeVisits;
+        if (!node->isLeaf()) {
+            int axis = node->getAxis();
+            Real split = node->getSplit();
+            Real start = ray.start.getCoordinate(axis);
+            Real tSplit = (split - start) * ray.inverseDirection.getCoordinate(axis);
+
+            bool leftIsNear = start < split || (start == split && ray.direction.getCoordinate(axis) <= 0);
+            const KDNode *leftNode = node + 1;
+            const KDNode *rightNode = &nodes[node->getRightChild()];
+            const KDNode *nearNode = leftIsNear ? leftNode : rightNode;
+            const KDNode *farNode = leftIsNear ? rightNode : leftNode;
+
+            if (tSplit > tMax || tSplit <= 0) {
+                node = nearNode;
+            }
+            else if (tSplit < tMin) {
+                node = farNode;
+            }
+            else {
+                stack[stackSize++] = {farNode, tSplit, tMax};
+                node = nearNode;
+                tMax = tSplit;
             }
+            continue;
         }
-        return nearestIntersection.distance < std::numeric_limits<double>::infinity();
+
+        if (visitLeaf(node, tMax) || stackSize == 0) {
+            return;
+        }
+
+        --stackSize;
+        node = stack[stackSize].node;
+        tMin = stack[stackSize].tMin;
+        tMax = stack[stackSize].tMax;
     }
-    else {
-        if ((plane == XY && rayDirection.getZ() > 0) ||
-            (plane == XZ && rayDirection.getY() > 0) ||
-            (plane == YZ && rayDirection.getX() > 0)) {
-            if (!left->findRayIntersection(rayStart, rayDirection, nearestIntersection)) {
-                return right->findRayIntersection(rayStart, rayDirection, nearestIntersection);
+}
+
+// Only the position of the hits along the ray is compared, the surface data is computed for the nearest one
+bool KDTree::findRayIntersection(const Point &rayStart, const Vector &rayDirection,
+                                 Intersection &nearestIntersection) const {
+    Hit nearestHit;
+    uint32_t nearestElement;
+    if (!findNearestHit(rayStart, rayDirection, nearestHit, nearestElement)) {
+        return false;
+    }
+    getIntersection(nearestElement, rayStart, rayDirection, nearestHit, nearestIntersection);
+    return true;
+}
+
+bool KDTree::findNearestHit(const Point &rayStart, const Vector &rayDirection, Hit &nearestHit,
+                            uint32_t &element) const {
+    nearestHit.t = std::numeric_limits<Real>::infinity();
+    element = 0;
+    LocalCounter primitiveTests(Statistics::PrimitiveTests);
+
+    traverse(Ray(rayStart, rayDirection), std::numeric_limits<Real>::infinity(),
+             [&](const KDNode *leaf, Real tMax) {
+                 primitiveTests += intersectLeaf(leaf, rayStart, rayDirection, [&](uint32_t current, const Hit &hit) {
+                     if (hit.t < nearestHit.t) {
+                         nearestHit = hit;
+                         element = current;
+                     }
+                     return false;
+                 });
+
+                 // a hit inside the current cell can't be preceded by hits from the farther cells
+                 return nearestHit.t <= tMax;
+             });
+
+    return nearestHit.t < std::numeric_limits<Real>::infinity();
+}
+
+// Any-hit query for shadow rays: the first primitive found before maxDistance ends the search.
+// The end of the segment is usually a surface point, its own surface is skipped with a tolerance
+// relative to the length, as the rounding error of the hit point grows with the distance.
+bool KDTree::isOccluded(const Point &rayStart, const Vector &rayDirection, Real maxDistance) const {
+    bool occluded = false;
+    Real maxT = maxDistance / rayDirection.length();
+    Real blockingT = maxT * (1 - Point::eps);
+    LocalCounter primitiveTests(Statistics::PrimitiveTests);
+
+    traverse(Ray(rayStart, rayDirection), maxT,
+             [&](const KDNode *leaf, Real) {
+                 primitiveTests += intersectLeaf(leaf, rayStart, rayDirection, [&](uint32_t, const Hit &hit) {
+                     occluded = hit.t < blockingT;
+                     return occluded;
+                 });
+                 return occluded;
+             });
+
+    return occluded;
+}
+
+#ifdef RAYTRACING_PACKETS
+
+// The traversal of a single ray done for all lanes at once: every lane keeps its own [tMin, tMax],
+// a cell is visited when it is crossed by any of the lanes and the lanes which don't cross it are masked off.
+// Lanes are done when they have a hit inside the current cell, the packet stops when all of them are done.
+PACKET_TARGET_CLONES
+void KDTree::tracePacket(const RayPacket &packet, PacketReal &nearestT, PacketInt &nearestElement) const {
+    nearestT = PacketReal{} + std::numeric_limits<Real>::infinity();
+    nearestElement = PacketInt{} - 1;
+    if (nodesCount == 0) {
+        return;
+    }
+
+    const Point *bounds[2] = {&sceneBox.minCorner, &sceneBox.maxCorner};
+    PacketReal tMin = PacketReal{};
+    PacketReal tMax = PacketReal{} + std::numeric_limits<Real>::infinity();
+    for (int axis = 0; axis < 3; ++axis) {
+        const PacketReal &start = packet.start.getCoordinate(axis);
+        const PacketReal &inverseDirection = packet.inverseDirection.getCoordinate(axis);
+        PacketReal slabMin = (bounds[packet.sign[axis]]->getCoordinate(axis) - start) * inverseDirection;
+        PacketReal slabMax = (bounds[1 - packet.sign[axis]]->getCoordinate(axis) - start) * inverseDirection;
+        tMin = slabMin > tMin ? slabMin : tMin;
+        tMax = slabMax < tMax ? slabMax : tMax;
+    }
+    tMax *= 1 + 4 * std::numeric_limits<Real>::epsilon();
+
+    PacketInt done = tMin > tMax;
+    if (allLanes(done)) {
+        return;
+    }
+
+    struct StackEntry {
+        const KDNode *node;
+        PacketReal tMin, tMax;
+    };
+    StackEntry stack[maxTreeDepth];
+    int stackSize = 0;
+
+    const KDNode *node = nodes;
+    LocalCounter nodeVisits(Statistics::PacketNodeVisits);
+    LocalCounter primitiveTests(Statistics::PacketPrimitiveTests);
+
+    while (true) {
+        PacketInt active = ~done & (tMin <= tMax);
+
+        if (anyLane(active)) {
+            ++nodeVisits;
+            if (!node->isLeaf()) {
+                int axis = node->getAxis();
+                PacketReal tSplit = (node->getSplit() - packet.start.getCoordinate(axis)) *
+                                      packet.inverseDirection.getCoordinate(axis);
+
+                const KDNode *leftNode = node + 1;
+                const KDNode *rightNode = &nodes[node->getRightChild()];
+                const KDNode *nearNode = packet.sign[axis] ? rightNode : leftNode;
+                const KDNode *farNode = packet.sign[axis] ? leftNode : rightNode;
+
+                PacketInt needNear = active & (tSplit >= tMin);
+                PacketInt needFar = active & (tSplit <= tMax);
+                PacketReal nearTMax = tSplit < tMax ? tSplit : tMax;
+                PacketReal farTMin = tSplit > tMin ? tSplit : tMin;
+
+                if (!anyLane(needFar)) {
+                    node = nearNode;
+                    tMax = nearTMax;
+                }
+                else if (!anyLane(needNear)) {
+                    node = farNode;
+                    tMin = farTMin;
+                }
+                else {
+                    stack[stackSize++] = {farNode, farTMin, tMax};
+                    node = nearNode;
+                    tMax = nearTMax;
+                }
+                continue;
             }
-            else {
-                Intersection intersection = nearestIntersection;
-                right->findRayIntersection(rayStart, rayDirection, intersection);
-                if (intersection.distance < nearestIntersection.distance)
-                    nearestIntersection = intersection;
-                return nearestIntersection.distance < std::numeric_limits<double>::infinity();
+
+            const uint32_t *leafPrimitives = primitiveIndices + node->getPrimitivesOffset();
+            primitiveTests += node->getPrimitivesCount();
+            for (uint32_t i = 0; i < node->getPrimitivesCount(); ++i) {
+                if (leafPrimitives[i] < elementTypeEnds[MeshTriangleElement]) {
+                    const MeshTriangle &triangle = meshTriangles[leafPrimitives[i]];
+                    PacketInt closer = triangle.mesh->intersectElementWithPacket(triangle.index, packet, active,
+                                                                                 nearestT);
+                    PacketInt element = PacketInt{} + static_cast<PacketIntLane>(leafPrimitives[i]);
+                    nearestElement = closer ? element : nearestElement;
+                    continue;
+                }
+
+                for (int lane = 0; lane < packetSize; ++lane) {
+                    Hit hit;
+                    if (active[lane] &&
+                        findHit(leafPrimitives[i], packet.start.getLane(lane), packet.direction.getLane(lane), hit) &&
+                        hit.t < nearestT[lane]) {
+                        nearestT[lane] = hit.t;
+                        nearestElement[lane] = leafPrimitives[i];
+                    }
+                }
             }
+
+            // the same termination as for a single ray, lane by lane
+            done |= nearestT <= tMax;
+            if (allLanes(done)) {
+                return;
+            }
+        }
+
+        if (stackSize == 0) {
+            return;
+        }
+        --stackSize;
+        node = stack[stackSize].node;
+        tMin = stack[stackSize].tMin;
+        tMax = stack[stackSize].tMax;
+    }
+}
+
+void KDTree::findPacketIntersection(const RayPacket &packet, Intersection intersections[], bool found[]) const {
+    if (!packet.isCoherent) {
+        for (int lane = 0; lane < packetSize; ++lane) {
+            found[lane] = findRayIntersection(packet.start.getLane(lane), packet.direction.getLane(lane),
+                                              intersections[lane]);
+        }
+        return;
+    }
+
+    PacketReal nearestT;
+    PacketInt nearestElement;
+    tracePacket(packet, nearestT, nearestElement);
+
+    // the packet only finds the nearest element, the surface data is computed for it by the single ray code
+    for (int lane = 0; lane < packetSize; ++lane) {
+        found[lane] = false;
+        if (nearestElement[lane] < 0) {
+            continue;
+        }
+
+        Point start = packet.start.getLane(lane);
+        Vector direction = packet.direction.getLane(lane);
+        Hit hit;
+        found[lane] = findHit(nearestElement[lane], start, direction, hit);
+        if (found[lane]) {
+            getIntersection(nearestElement[lane], start, direction, hit, intersections[lane]);
         }
         else {
-            if (!right->findRayIntersection(rayStart, rayDirection, nearestIntersection)) {
-                return left->findRayIntersection(rayStart, rayDirection, nearestIntersection);
+            found[lane] = findRayIntersection(start, direction, intersections[lane]);
+        }
+    }
+}
+
+#endif
+
+// Sweeps sorted primitive bounds along every axis and returns the lowest SAH cost
+double KDTree::findBestSplit(BuildContext &context, const BoundingBox &nodeBox, int &splitAxis, Real &splitPosition,
+                             bool &planarToLeft) {
+    const std::vector<BoundingBox> &nodePrimitiveBoxes = context.clippedBoxes;
+    const KDTreeSettings &settings = context.settings;
+    double bestCost = std::numeric_limits<double>::infinity();
+    double nodeArea = nodeBox.getSurfaceArea();
+    if (!(nodeArea > 0)) {
+        return bestCost;
+    }
+
+    std::vector<SplitEvent> &events = context.events;
+
+    for (int axis = 0; axis < 3; ++axis) {
+        Real nodeMin = nodeBox.minCorner.getCoordinate(axis);
+        Real nodeMax = nodeBox.maxCorner.getCoordinate(axis);
+        if (!(nodeMin < nodeMax)) {
+            continue;
+        }
+
+        events.clear();
+        for (const BoundingBox &box : nodePrimitiveBoxes) {
+            Real minPosition = box.minCorner.getCoordinate(axis);
+            Real maxPosition = box.maxCorner.getCoordinate(axis);
+            if (minPosition == maxPosition) {
+                events.push_back(SplitEvent(minPosition, SplitEvent::PLANAR));
             }
             else {
-                Intersection intersection = nearestIntersection;
-                left->findRayIntersection(rayStart, rayDirection, intersection);
-                if (intersection.distance < nearestIntersection.distance)
-                    nearestIntersection = intersection;
-                return nearestIntersection.distance < std::numeric_limits<double>::infinity();
+                events.push_back(SplitEvent(minPosition, SplitEvent::START));
+                events.push_back(SplitEvent(maxPosition, SplitEvent::END));
             }
         }
-    }
-}
+        std::sort(events.begin(), events.end());
 
+        long leftCount = 0, rightCount = nodePrimitiveBoxes.size();
+        for (size_t i = 0; i < events.size();) {
+            Real position = events[i].position;
+            long endCount = 0, planarCount = 0, startCount = 0;
+            for (; i < events.size() && events[i].position == position && events[i].type == SplitEvent::END; ++i) {
+                ++endCount;
+            }
+            for (; i < events.size() && events[i].position == position && events[i].type == SplitEvent::PLANAR; ++i) {
+                ++planarCount;
+            }
+            for (; i < events.size() && events[i].position == position && events[i].type == SplitEvent::START; ++i) {
+                ++startCount;
+            }
 
+            rightCount -= planarCount + endCount;
 
+            if (nodeMin < position && position < nodeMax) {
+                BoundingBox leftBox = nodeBox, rightBox = nodeBox;
+                leftBox.maxCorner.setCoordinate(axis, position);
+                rightBox.minCorner.setCoordinate(axis, position);
+                double leftProbability = leftBox.getSurfaceArea() / nodeArea;
+                double rightProbability = rightBox.getSurfaceArea() / nodeArea;
 
+                for (int side = 0; side < 2; ++side) {
+                    long leftSideCount = leftCount + (side == 0 ? planarCount : 0);
+                    long rightSideCount = rightCount + (side == 1 ? planarCount : 0);
+                    double cost = settings.traversalCost + settings.intersectionCost *
+                                                           (leftProbability * leftSideCount +
+                                                            rightProbability * rightSideCount);
+                    if (leftSideCount == 0 || rightSideCount == 0) {
+                        cost *= 1 - settings.emptyBonus;
+                    }
 
+                    if (cost < bestCost) {
+                        bestCost = cost;
+                        splitAxis = axis;
+                        splitPosition = position;
+                        planarToLeft = side == 0;
+                    }
+                }
+            }
+
+            leftCount += startCount + planarCount;
+        }
+    }
+
+    return bestCost;
+}
@@ -1,69 +1,199 @@
 #ifndef RAYTRACING_KDTREE_H
 #define RAYTRACING_KDTREE_H
 
+#include <cstdint>
+#include <memory>
+#include <string>
 
+#include "MappedFile.h"
 #include "Vector.h"
 #include "Primitives.h"
+#include "ThreadPool.h"
 
-enum Plane {
-    XY, XZ, YZ, NONE
-};
+// Surface area heuristic parameters
+struct KDTreeSettings {
+    KDTreeSettings() : traversalCost(1), intersectionCost(1.5), emptyBonus(0.2), maxDepth(0), threadsCount(0),
+                       parallelCutoff(4096) { }
 
-class KDNode {
-    const static int maxRecursionDepth = 15;
-    const static int maxObjectsInList = 2;
+    double traversalCost;    // cost of visiting an inner node
+    double intersectionCost; // cost of one ray-primitive test
+    double emptyBonus;       // cost reduction of splits which cut off empty space
+    int maxDepth;            // 0 means 8 + 1.3 * log2(primitives count)
 
-    enum Plane plane;
+    int threadsCount;        // 0 means one thread per hardware core
+    int parallelCutoff;      // subtrees with fewer primitives are built by the thread that split their parent
 
-    BoundingBox boundingBox;
-    KDNode *left;
-    KDNode *right;
+    std::string cacheDirectory; // built trees are saved there and reused, empty disables the cache
+};
 
-    std::vector<Primitive *> nodePrimitives;
+struct KDTreeStats {
+    KDTreeStats() : nodesCount(0), leavesCount(0), emptyLeavesCount(0), maxDepth(0), primitivesCount(0),
+                    primitiveReferences(0), isCached(false) { }
+
+    int nodesCount;
+    int leavesCount;
+    int emptyLeavesCount;
+    int maxDepth;
+    long primitivesCount;
+    long primitiveReferences;
+    bool isCached;           // the tree was loaded from the cache instead of being built
+
+    // average number of primitives in non-empty leaves
+    double getLeafOccupancy() const {
+        return leavesCount > emptyLeavesCount ? primitiveReferences * 1.0 / (leavesCount - emptyLeavesCount) : 0;
+    }
 
-#ifdef COUNT_STATS
-    static int _buildCalls, _findCalls;
-#endif
+    // average number of leaves referencing a primitive
+    double getDuplicationFactor() const {
+        return primitivesCount > 0 ? primitiveReferences * 1.0 / primitivesCount : 0;
+    }
+};
+
+// Node of the flattened tree. The left child of an inner node is stored right after it,
+// the index of the right child is kept in the upper 30 bits of flags.
+// Leaves keep their primitives count there and point into KDTree::primitiveIndices.
+class KDNode {
+    const static uint32_t leafFlag = 3;
 
-    static void dividePrimitives(const Point &middlePoint, const Vector &planeNormal,
-                                 const std::vector<Primitive *> &primitives,
-                                 std::vector<Primitive *> &leftNodePrimitives,
-                                 std::vector<Primitive *> &rightNodePrimitives);
+    union {
+        float split;
+        uint32_t primitivesOffset;
+    };
+    uint32_t flags;
 
 public:
-    KDNode(const std::vector<Primitive *> &primitives, int iter, const BoundingBox &nodeBox);
+    void initInner(int axis, float split, uint32_t rightChild) {
+        this->split = split;
+        flags = static_cast<uint32_t>(axis) | (rightChild << 2);
+    }
 
-    ~KDNode() {
-        // doesn't delete primitives
-        delete left;
-        delete right;
+    void initLeaf(uint32_t primitivesOffset, uint32_t primitivesCount) {
+        this->primitivesOffset = primitivesOffset;
+        flags = leafFlag | (primitivesCount << 2);
     }
 
-    bool findRayIntersection(const Point &rayStart, const Vector &rayDirection, Intersection &nearestIntersection);
+    bool isLeaf() const { return (flags & 3) == leafFlag; }
+
+    int getAxis() const { return flags & 3; }
 
-#ifdef COUNT_STATS
-    static int _getBuildCalls() { return _buildCalls; }
-    static int _getFindCalls() { return _findCalls; }
-    static void _resetStats() {
-        _buildCalls = 0;
-        _findCalls = 0;
+    float getSplit() const { return split; }
+
+    uint32_t getRightChild() const { return flags >> 2; }
+
+    uint32_t getPrimitivesOffset() const { return primitivesOffset; }
+
+    uint32_t getPrimitivesCount() const { return flags >> 2; }
+
+    // moves a node of a subtree built separately to the place of the subtree in the final arrays
+    void relocate(uint32_t nodesOffset, uint32_t primitivesOffset) {
+        if (isLeaf()) {
+            this->primitivesOffset += primitivesOffset;
+        }
+        else {
+            flags += nodesOffset << 2;
+        }
     }
-#endif
 };
 
 class KDTree {
-    KDNode *root;
+    // traversal stack size
+    const static int maxTreeDepth = 64;
+
+    // Parts of the scene objects the tree is built over: whole primitives or triangles of meshes.
+    // They are numbered by type, so the sorted primitives of a leaf form one run per type, and every run
+    // is tested by the intersection of its type called directly. Subclasses of the primitive types
+    // are tested as other primitives through the virtual call.
+    enum ElementType {
+        MeshTriangleElement, TriangleElement, SphereElement, PolygonElement, OtherElement, ElementTypesCount
+    };
+
+    struct MeshTriangle {
+        const TriangleMesh *mesh;
+        uint32_t index;
+    };
+
+    // arrays of the tree built in memory, they stay empty when the tree is mapped from the cache
+    std::vector<KDNode> builtNodes;
+    std::vector<uint32_t> builtPrimitiveIndices;
+    std::unique_ptr<MappedFile> cacheFile;
+
+    // the arrays being traversed
+    const KDNode *nodes;
+    size_t nodesCount;
+    const uint32_t *primitiveIndices;
+
+    // the elements of every type, elementTypeEnds[type] is the number of the elements of this and previous types
+    std::vector<MeshTriangle> meshTriangles;
+    std::vector<const Triangle *> triangles;
+    std::vector<const Sphere *> spheres;
+    std::vector<const Polygon *> polygons;
+    std::vector<const Primitive *> otherPrimitives;
+    uint32_t elementTypeEnds[ElementTypesCount];
+    BoundingBox sceneBox;
+    KDTreeStats stats;
+
+    struct BuildContext;
+
+    friend class KDTreeCache;
+
+    static void buildNode(BuildContext &context, size_t primitivesBegin, int depth, const BoundingBox &nodeBox);
+
+    static void makeLeaf(BuildContext &context, uint32_t node, size_t primitivesBegin, int depth);
+
+    static void appendSubtree(BuildContext &context, const BuildContext &subtree);
+
+    static double findBestSplit(BuildContext &context, const BoundingBox &nodeBox, int &splitAxis,
+                                Real &splitPosition, bool &planarToLeft);
+
+    size_t getElementsCount() const { return elementTypeEnds[ElementTypesCount - 1]; }
+
+    void addElements(const std::vector<Primitive *> &primitives, std::vector<BoundingBox> &elementBoxes);
+
+    template <ElementType type>
+    bool findHitOfType(uint32_t element, const Point &rayStart, const Vector &rayDirection, Hit &hit) const;
+
+    bool findHit(uint32_t element, const Point &rayStart, const Vector &rayDirection, Hit &hit) const;
+
+    template <ElementType type, class HitHandler>
+    bool intersectRun(const uint32_t *&element, const uint32_t *leafEnd, const Point &rayStart,
+                      const Vector &rayDirection, HitHandler &handleHit) const;
+
+    template <class HitHandler>
+    uint32_t intersectLeaf(const KDNode *leaf, const Point &rayStart, const Vector &rayDirection,
+                           HitHandler handleHit) const;
+
+    template <class LeafVisitor>
+    void traverse(const Ray &ray, Real maxT, LeafVisitor visitLeaf) const;
+
+#ifdef RAYTRACING_PACKETS
+    void tracePacket(const RayPacket &packet, PacketReal &nearestT, PacketInt &nearestElement) const;
+#endif
 
 public:
-    KDTree() : root(nullptr) { }
+    KDTree() : nodes(nullptr), nodesCount(0), primitiveIndices(nullptr), elementTypeEnds() { }
 
-    ~KDTree() {
-        delete root;
-    }
+    // Builds the tree or maps it from settings.cacheDirectory if the same tree was built before
+    void buildTree(const std::vector<Primitive *> &primitives, const KDTreeSettings &settings = KDTreeSettings());
 
-    void buildTree(const std::vector<Primitive *> &primitives);
+    bool findRayIntersection(const Point &rayStart, const Vector &rayDirection, Intersection &nearestIntersection) const;
+
+    // The nearest hit and the element it belongs to, the surface data is left for getIntersection.
+    // Lets primitives keep a tree of their own parts.
+    bool findNearestHit(const Point &rayStart, const Vector &rayDirection, Hit &nearestHit, uint32_t &element) const;
+
+    // the surface data of the hit, computed once for the nearest one
+    void getIntersection(uint32_t element, const Point &rayStart, const Vector &rayDirection, const Hit &hit,
+                         Intersection &intersection) const;
+
+    // true if any primitive is hit closer than maxDistance, the nearest hit isn't searched for
+    bool isOccluded(const Point &rayStart, const Vector &rayDirection, Real maxDistance) const;
+
+#ifdef RAYTRACING_PACKETS
+    // closest hits of all rays of the packet, found[lane] tells if the lane ray hits anything
+    void findPacketIntersection(const RayPacket &packet, Intersection intersections[], bool found[]) const;
+#endif
 
-    bool findRayIntersection(const Point &rayStart, const Vector &rayDirection, Intersection &nearestIntersection);
+    const KDTreeStats &getStats() const { return stats; }
 };
 
 #endif //RAYTRACING_KDTREE_H
@@ -0,0 +1,282 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+#include "KDTreeCache.h"
+
+namespace {
+    const char cacheMagic[8] = {'R', 'T', 'K', 'D', 'T', 'R', 'E', 'E'};
+    const char meshMagic[8] = {'R', 'T', 'M', 'E', 'S', 'H', 0, 0};
+    const uint32_t byteOrderMark = 0x01020304;
+
+    const uint64_t hashBasis = 0xcbf29ce484222325ULL;
+
+    // 64-bit FNV-1a
+    uint64_t hashBytes(uint64_t hash, const void *data, size_t size) {
+        const unsigned char *bytes = static_cast<const unsigned char *>(data);
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    void makeDirectory(const std::string &directory) {
+#ifdef _WIN32
+        _mkdir(directory.c_str());
+#else
+        mkdir(directory.c_str(), 0755);
+#endif
+    }
+
+    // Writes the parts to a temporary file renamed to the path at the end, so readers never see a partly
+    // written file. The directory is created if it doesn't exist.
+    bool replaceFile(const std::string &directory, const std::string &filePath,
+                     const std::vector<std::pair<const void *, size_t>> &parts) {
+        makeDirectory(directory);
+        std::string temporaryPath = filePath + ".tmp";
+        {
+            std::ofstream fileStream(temporaryPath, std::ios::binary | std::ios::trunc);
+            for (const auto &part : parts) {
+                fileStream.write(static_cast<const char *>(part.first), part.second);
+            }
+            fileStream.close();
+            if (fileStream.fail()) {
+                std::remove(temporaryPath.c_str());
+                return false;
+            }
+        }
+
+#ifdef _WIN32
+        std::remove(filePath.c_str());
+#endif
+        return std::rename(temporaryPath.c_str(), filePath.c_str()) == 0;
+    }
+}
+
+const uint32_t KDTreeCache::version;
+
+std::string KDTreeCache::getFilePath(const std::string &directory, uint64_t key, const char *extension) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.%s", static_cast<unsigned long long>(key), extension);
+    return directory + "/" + name;
+}
+
+// The threads count and the parallel cutoff don't change the tree, so they are left out
+uint64_t KDTreeCache::getKey(const std::vector<BoundingBox> &elementBoxes, const KDTreeSettings &settings,
+                             int maxDepth) {
+    uint64_t hash = hashBasis;
+    uint32_t realSize = sizeof(Real);
+    uint64_t elementsCount = elementBoxes.size();
+    hash = hashBytes(hash, &realSize, sizeof(realSize));
+    hash = hashBytes(hash, &maxDepth, sizeof(maxDepth));
+    hash = hashBytes(hash, &settings.traversalCost, sizeof(settings.traversalCost));
+    hash = hashBytes(hash, &settings.intersectionCost, sizeof(settings.intersectionCost));
+    hash = hashBytes(hash, &settings.emptyBonus, sizeof(settings.emptyBonus));
+    hash = hashBytes(hash, &elementsCount, sizeof(elementsCount));
+    return hashBytes(hash, elementBoxes.data(), elementBoxes.size() * sizeof(BoundingBox));
+}
+
+uint64_t KDTreeCache::getChecksum(const KDNode *nodes, uint64_t nodesCount, const uint32_t *primitiveIndices,
+                                  uint64_t primitiveIndicesCount) {
+    uint64_t hash = hashBytes(hashBasis, nodes, nodesCount * sizeof(KDNode));
+    return hashBytes(hash, primitiveIndices, primitiveIndicesCount * sizeof(uint32_t));
+}
+
+bool KDTreeCache::isValid(const KDNode *nodes, uint64_t nodesCount, const uint32_t *primitiveIndices,
+                          uint64_t primitiveIndicesCount, uint64_t elementsCount) {
+    // the traversal stacks hold one entry per level, so no node may be deeper than they allow
+    std::vector<int> depths(nodesCount, -1);
+    if (nodesCount != 0) {
+        depths[0] = 0;
+    }
+    for (uint64_t i = 0; i < nodesCount; ++i) {
+        if (depths[i] < 0 || depths[i] > KDTree::maxTreeDepth) {
+            return false;
+        }
+        if (nodes[i].isLeaf()) {
+            if (static_cast<uint64_t>(nodes[i].getPrimitivesOffset()) + nodes[i].getPrimitivesCount() >
+                primitiveIndicesCount) {
+                return false;
+            }
+            continue;
+        }
+        // both children follow their parent, so the traversal can't loop and the depth of a node is
+        // known before it is reached; a node with two parents would make it ambiguous
+        uint64_t rightChild = nodes[i].getRightChild();
+        if (i + 1 >= nodesCount || rightChild <= i + 1 || rightChild >= nodesCount ||
+            depths[i + 1] >= 0 || depths[rightChild] >= 0) {
+            return false;
+        }
+        depths[i + 1] = depths[rightChild] = depths[i] + 1;
+    }
+    for (uint64_t i = 0; i < primitiveIndicesCount; ++i) {
+        if (primitiveIndices[i] >= elementsCount) {
+            return false;
+        }
+    }
+    // the intersection of a leaf relies on its elements being sorted
+    for (uint64_t i = 0; i < nodesCount; ++i) {
+        if (nodes[i].isLeaf()) {
+            const uint32_t *leafBegin = primitiveIndices + nodes[i].getPrimitivesOffset();
+            if (!std::is_sorted(leafBegin, leafBegin + nodes[i].getPrimitivesCount())) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool KDTreeCache::load(KDTree &tree, const std::string &directory, uint64_t key) {
+    std::unique_ptr<MappedFile> file;
+    try {
+        file.reset(new MappedFile(getFilePath(directory, key, "kdtree"), false));
+    }
+    catch (const std::runtime_error &) {
+        return false;
+    }
+
+    Header header;
+    if (file->getSize() < sizeof(Header)) {
+        return false;
+    }
+    std::memcpy(&header, file->getData(), sizeof(Header));
+    if (std::memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) != 0 || header.version != version ||
+        header.byteOrder != byteOrderMark || header.key != key || header.elementsCount != tree.getElementsCount() ||
+        header.maxDepth < 0 || header.maxDepth > KDTree::maxTreeDepth) {
+        return false;
+    }
+
+    uint64_t arraysSize = file->getSize() - sizeof(Header);
+    if (header.nodesCount > arraysSize / sizeof(KDNode)) {
+        return false;
+    }
+    uint64_t indicesSize = arraysSize - header.nodesCount * sizeof(KDNode);
+    if (indicesSize % sizeof(uint32_t) != 0 || header.primitiveIndicesCount != indicesSize / sizeof(uint32_t)) {
+        return false;
+    }
+
+    // the header and the nodes take a multiple of 8 bytes, so the mapped arrays are aligned
+    const KDNode *nodes = reinterpret_cast<const KDNode *>(file->getData() + sizeof(Header));
+    const uint32_t *primitiveIndices = reinterpret_cast<const uint32_t *>(nodes + header.nodesCount);
+    if (getChecksum(nodes, header.nodesCount, primitiveIndices, header.primitiveIndicesCount) != header.checksum ||
+        !isValid(nodes, header.nodesCount, primitiveIndices, header.primitiveIndicesCount, header.elementsCount)) {
+        return false;
+    }
+
+    tree.nodes = nodes;
+    tree.nodesCount = header.nodesCount;
+    tree.primitiveIndices = primitiveIndices;
+    tree.cacheFile = std::move(file);
+
+    tree.stats = KDTreeStats();
+    tree.stats.nodesCount = static_cast<int>(header.nodesCount);
+    tree.stats.leavesCount = static_cast<int>(header.leavesCount);
+    tree.stats.emptyLeavesCount = static_cast<int>(header.emptyLeavesCount);
+    tree.stats.maxDepth = static_cast<int>(header.maxDepth);
+    tree.stats.primitivesCount = static_cast<long>(header.elementsCount);
+    tree.stats.primitiveReferences = static_cast<long>(header.primitiveReferences);
+    tree.stats.isCached = true;
+    return true;
+}
+
+bool KDTreeCache::save(const KDTree &tree, const std::string &directory, uint64_t key) {
+    static_assert(sizeof(Header) % 8 == 0 && sizeof(KDNode) == 8, "the mapped arrays must stay aligned");
+
+    Header header;
+    std::memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+    header.version = version;
+    header.byteOrder = byteOrderMark;
+    header.key = key;
+    header.elementsCount = tree.getElementsCount();
+    header.nodesCount = tree.nodesCount;
+    header.primitiveIndicesCount = tree.builtPrimitiveIndices.size();
+    header.leavesCount = tree.stats.leavesCount;
+    header.emptyLeavesCount = tree.stats.emptyLeavesCount;
+    header.maxDepth = tree.stats.maxDepth;
+    header.primitiveReferences = tree.stats.primitiveReferences;
+    header.checksum = getChecksum(tree.nodes, tree.nodesCount, tree.primitiveIndices, header.primitiveIndicesCount);
+
+    return replaceFile(directory, getFilePath(directory, key, "kdtree"),
+                       {{&header, sizeof(Header)}, {tree.nodes, tree.nodesCount * sizeof(KDNode)},
+                        {tree.primitiveIndices, header.primitiveIndicesCount * sizeof(uint32_t)}});
+}
+
+// Hashing the contents would take longer than parsing them, so a file is assumed unchanged while its size
+// and modification time stay the same. The values depend on the size of Real, so it is a part of the key.
+bool KDTreeCache::getFileKey(const std::string &filePath, uint64_t &key) {
+    struct stat fileStat;
+    if (stat(filePath.c_str(), &fileStat) != 0) {
+        return false;
+    }
+    uint32_t realSize = sizeof(Real);
+    int64_t size = fileStat.st_size, modificationTime = fileStat.st_mtime;
+    key = hashBytes(hashBasis, &realSize, sizeof(realSize));
+    key = hashBytes(key, &size, sizeof(size));
+    key = hashBytes(key, &modificationTime, sizeof(modificationTime));
+    key = hashBytes(key, filePath.data(), filePath.size());
+    return true;
+}
+
+bool KDTreeCache::loadMesh(TriangleMesh &mesh, const std::string &directory, uint64_t key) {
+    std::unique_ptr<MappedFile> file;
+    try {
+        file.reset(new MappedFile(getFilePath(directory, key, "mesh"), false));
+    }
+    catch (const std::runtime_error &) {
+        return false;
+    }
+
+    MeshHeader header;
+    if (mesh.getTrianglesCount() != 0 || file->getSize() < sizeof(MeshHeader)) {
+        return false;
+    }
+    std::memcpy(&header, file->getData(), sizeof(MeshHeader));
+    if (std::memcmp(header.magic, meshMagic, sizeof(meshMagic)) != 0 || header.version != version ||
+        header.byteOrder != byteOrderMark || header.key != key ||
+        header.trianglesCount > (file->getSize() - sizeof(MeshHeader)) / (9 * sizeof(Real)) ||
+        file->getSize() != sizeof(MeshHeader) + header.trianglesCount * 9 * sizeof(Real)) {
+        return false;
+    }
+
+    // the header takes a multiple of 8 bytes, so the arrays are aligned
+    const Real *values = reinterpret_cast<const Real *>(file->getData() + sizeof(MeshHeader));
+    size_t count = header.trianglesCount;
+    TriangleMesh::Coordinates *coordinates[3] = {&mesh.vertices, &mesh.edges1, &mesh.edges2};
+    for (int i = 0; i < 3; ++i) {
+        *coordinates[i] = TriangleMesh::Coordinates{values + 3 * i * count, values + (3 * i + 1) * count,
+                                                    values + (3 * i + 2) * count};
+    }
+    mesh.trianglesCount = count;
+    mesh.cacheFile = std::move(file);
+    return true;
+}
+
+bool KDTreeCache::saveMesh(const TriangleMesh &mesh, const std::string &directory, uint64_t key) {
+    static_assert(sizeof(MeshHeader) % 8 == 0, "the mapped arrays must stay aligned");
+
+    MeshHeader header;
+    std::memcpy(header.magic, meshMagic, sizeof(meshMagic));
+    header.version = version;
+    header.byteOrder = byteOrderMark;
+    header.key = key;
+    header.trianglesCount = mesh.getTrianglesCount();
+
+    size_t arraySize = header.trianglesCount * sizeof(Real);
+    std::vector<std::pair<const void *, size_t>> parts = {{&header, sizeof(MeshHeader)}};
+    for (const TriangleMesh::Coordinates *coordinates : {&mesh.vertices, &mesh.edges1, &mesh.edges2}) {
+        parts.push_back({coordinates->x, arraySize});
+        parts.push_back({coordinates->y, arraySize});
+        parts.push_back({coordinates->z, arraySize});
+    }
+    return replaceFile(directory, getFilePath(directory, key, "mesh"), parts);
+}
@@ -0,0 +1,73 @@
+#ifndef RAYTRACING_KDTREECACHE_H
+#define RAYTRACING_KDTREECACHE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "KDTree.h"
+
+// Built trees saved to files which are mapped back without any parsing. A tree depends only on the element
+// bounds and the build settings, so a file is named after their hash and a changed scene simply gets another file.
+// The layout is a fixed header followed by the node and the primitive index arrays as they are kept in memory.
+// The triangles parsed from text mesh files are kept the same way next to the trees, named after the path,
+// the size and the modification time of the file, and a model seen before is mapped back instead of being parsed.
+class KDTreeCache {
+    // bump when the file layout or the tree built from the same input changes
+    static const uint32_t version = 3;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t byteOrder;
+        uint64_t key;
+        uint64_t elementsCount;
+        uint64_t nodesCount;
+        uint64_t primitiveIndicesCount;
+        int64_t leavesCount;
+        int64_t emptyLeavesCount;
+        int64_t maxDepth;
+        int64_t primitiveReferences;
+        uint64_t checksum;  // hash of the arrays
+    };
+
+    // Followed by the coordinate arrays of the mesh, each of trianglesCount values. They have no checksum,
+    // as wrong coordinates can only spoil the image, unlike the indices of a tree.
+    struct MeshHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t byteOrder;
+        uint64_t key;
+        uint64_t trianglesCount;
+    };
+
+    static uint64_t getChecksum(const KDNode *nodes, uint64_t nodesCount, const uint32_t *primitiveIndices,
+                                uint64_t primitiveIndicesCount);
+
+    static std::string getFilePath(const std::string &directory, uint64_t key, const char *extension);
+
+    // checks that the arrays of a mapped file can be traversed safely, in case the checksum matches by chance
+    static bool isValid(const KDNode *nodes, uint64_t nodesCount, const uint32_t *primitiveIndices,
+                        uint64_t primitiveIndicesCount, uint64_t elementsCount);
+
+public:
+    static uint64_t getKey(const std::vector<BoundingBox> &elementBoxes, const KDTreeSettings &settings,
+                           int maxDepth);
+
+    // Maps the tree into the tree arrays. Returns false if there is no file of this version for the key.
+    static bool load(KDTree &tree, const std::string &directory, uint64_t key);
+
+    // Returns false if the file can't be written, the directory is created if it doesn't exist
+    static bool save(const KDTree &tree, const std::string &directory, uint64_t key);
+
+    // Key of the mesh loaded from the file, the contents aren't read. Returns false if the file can't be found.
+    static bool getFileKey(const std::string &filePath, uint64_t &key);
+
+    // Maps the triangles saved for the key into the empty mesh. Returns false if there is no file of this version.
+    static bool loadMesh(TriangleMesh &mesh, const std::string &directory, uint64_t key);
+
+    static bool saveMesh(const TriangleMesh &mesh, const std::string &directory, uint64_t key);
+};
+
+
+#endif //RAYTRACING_KDTREECACHE_H
@@ -0,0 +1,46 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "LoadFromFile.h"
+#include "LoadFromRt.h"
+#include "LoadFromStl.h"
+
+namespace {
+    bool hasExtension(const std::string &filePath, const std::string &extension) {
+        return filePath.size() >= extension.size() &&
+               filePath.compare(filePath.size() - extension.size(), extension.size(), extension) == 0;
+    }
+}
+
+// 4:3 screen in front of the box with a margin around it
+Screen LoadFromFile::getModelScreen(const BoundingBox &box) {
+    Vector size = box.maxCorner - box.minCorner;
+    Real height = std::max(size.getY(), size.getX() * 3 / 4) * 1.2;
+    if (height <= 0) {
+        height = 1;
+    }
+    Real width = height * 4 / 3;
+
+    Point center = box.minCorner + size * 0.5;
+    Point leftBottomCorner(center.getX() - width / 2, center.getY() - height / 2, box.maxCorner.getZ());
+    return Screen(leftBottomCorner, Vector(width, 0, 0), Vector(0, height, 0));
+}
+
+void LoadFromFile::load(const std::string &filePath, Scene &scene, Screen &screen,
+                        const std::string &cacheDirectory) {
+    if (hasExtension(filePath, ".rt")) {
+        LoadFromRt::load(filePath, scene, screen, cacheDirectory);
+    }
+    else if (hasExtension(filePath, ".stl")) {
+        LoadFromStl::load(filePath, Material(Color(1, 0, 0), 0, 0), scene, cacheDirectory);
+
+        BoundingBox box = scene.getBoundingBox();
+        screen = getModelScreen(box);
+        // the intensity falls with the squared distance, so the model center gets the intensity 1
+        Point center = box.minCorner + (box.maxCorner - box.minCorner) * 0.5;
+        scene.addLightSource(LightSource(screen.camera, (screen.camera - center).squaredLength()));
+    }
+    else {
+        throw std::runtime_error("unknown scene format " + filePath);
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef RAYTRACING_LOADFROMFILE_H
+#define RAYTRACING_LOADFROMFILE_H
+
+#include <string>
+
+#include "Scene.h"
+#include "Render.h"
+
+// Scene of any supported file. The .rt files describe the camera and the lights themselves,
+// .stl models are painted red and looked at along -z with a light at the camera.
+class LoadFromFile {
+    static Screen getModelScreen(const BoundingBox &box);
+
+public:
+    // Throws std::runtime_error if the file can't be loaded or its extension is unknown.
+    // The meshes are loaded through the cache in cacheDirectory unless it is empty.
+    static void load(const std::string &filePath, Scene &scene, Screen &screen,
+                     const std::string &cacheDirectory = "");
+};
+
+
+#endif //RAYTRACING_LOADFROMFILE_H
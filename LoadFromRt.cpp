@@ -1,20 +1,29 @@
+#include <cmath>
 #include <fstream>
+#include <limits>
+#include <stdexcept>
 
 #include "LoadFromRt.h"
+#include "LoadFromStl.h"
+#include "Statistics.h"
 
 
-void LoadFromRt::load(const std::string &filePath, Scene &scene, Screen &screen) {
+void LoadFromRt::load(const std::string &filePath, Scene &scene, Screen &screen,
+                      const std::string &cacheDirectory) {
+    PhaseTimer timer(Statistics::Parse);
     std::ifstream fileStream(filePath);
 
     if (!fileStream.good()) {
-        throw "file opening error";
+        throw std::runtime_error("can't open " + filePath);
     }
 
     std::string currentToken;
     std::map<std::string, Material> materials;
+    // the files of the meshes are relative to the scene file
+    std::string directory = filePath.substr(0, filePath.find_last_of("/\\") + 1);
 
     while (true) {
-        fileStream >> currentToken;
+        currentToken = readToken(fileStream);
 
         if (currentToken == "viewport") {
             screen = readViewport(fileStream);
@@ -26,7 +35,7 @@ void LoadFromRt::load(const std::string &filePath, Scene &scene, Screen &screen)
             readLights(fileStream, scene);
         }
         else { // geometry
-            readGeometry(fileStream, scene, materials);
+            readGeometry(fileStream, scene, materials, directory, cacheDirectory);
             break;
         }
     }
@@ -34,6 +43,45 @@ void LoadFromRt::load(const std::string &filePath, Scene &scene, Screen &screen)
     fileStream.close();
 }
 
+std::vector<Screen> LoadFromRt::loadViews(const std::string &filePath) {
+    std::ifstream fileStream(filePath);
+
+    if (!fileStream.good()) {
+        throw std::runtime_error("can't open " + filePath);
+    }
+
+    std::vector<Screen> screens;
+    std::string currentToken;
+    while (fileStream >> currentToken) {
+        if (currentToken[0] == '#') {
+            fileStream.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        }
+        else if (currentToken == "viewport") {
+            screens.push_back(readViewport(fileStream));
+        }
+        else {
+            throw std::runtime_error("unexpected " + currentToken + " in the views file " + filePath);
+        }
+    }
+
+    if (screens.empty()) {
+        throw std::runtime_error("no views in " + filePath);
+    }
+    return screens;
+}
+
+// Next word of the file, comments from # to the end of the line are skipped
+std::string LoadFromRt::readToken(std::ifstream &fileStream) {
+    std::string token;
+    while (fileStream >> token) {
+        if (token[0] != '#') {
+            return token;
+        }
+        fileStream.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    }
+    throw std::runtime_error("unexpected end of the scene file");
+}
+
 Point LoadFromRt::readPoint(std::ifstream &fileStream) {
     double x, y, z;
     fileStream >> x >> y >> z;
@@ -50,8 +98,15 @@ Screen LoadFromRt::readViewport(std::ifstream &fileStream) {
     std::string currentToken;
 
     Point origin, topLeftCorner, bottomLeftCorner, topRightCorner;
-    for (int i = 0; i < 4; ++i) {
-        fileStream >> currentToken;
+    while (true) {
+        currentToken = readToken(fileStream);
+        if (currentToken == "endviewport") {
+            break;
+        }
+        else if (currentToken == "screen" || currentToken == "endscreen") {
+            continue; // the corners may be grouped in a block
+        }
+
         Point currentPoint = readPoint(fileStream);
         if (currentToken == "origin") {
             origin = currentPoint;
@@ -67,8 +122,6 @@ Screen LoadFromRt::readViewport(std::ifstream &fileStream) {
         }
     }
 
-    fileStream >> currentToken; // endviewport
-
     return Screen(origin, bottomLeftCorner, topRightCorner - topLeftCorner, topLeftCorner - bottomLeftCorner);
 }
 
@@ -77,7 +130,7 @@ std::map<std::string, Material> LoadFromRt::readMaterials(std::ifstream &fileStr
     std::map<std::string, Material> materials;
 
     while (true) {
-        fileStream >> currentToken; // entry or endmaterials
+        currentToken = readToken(fileStream); // entry or endmaterials
 
         if (currentToken == "endmaterials") {
             break;
@@ -87,9 +140,12 @@ std::map<std::string, Material> LoadFromRt::readMaterials(std::ifstream &fileStr
         Color color(0, 0, 0);
         double reflect = 0, refract = 0;
 
-        for (int i = 0; i < 5; ++i) {
-            fileStream >> currentToken;
-            if (currentToken == "name") {
+        while (true) {
+            currentToken = readToken(fileStream);
+            if (currentToken == "endentry") {
+                break;
+            }
+            else if (currentToken == "name") {
                 fileStream >> name;
             }
             else if (currentToken == "color") {
@@ -101,8 +157,8 @@ std::map<std::string, Material> LoadFromRt::readMaterials(std::ifstream &fileStr
             else if (currentToken == "refract") {
                 fileStream >> refract;
             }
-            else {
-                break; // endentry
+            else { // alpha, specular, shininess and texture aren't supported
+                readToken(fileStream);
             }
         }
 
@@ -117,11 +173,11 @@ void LoadFromRt::readLights(std::ifstream &fileStream, Scene &scene) {
     double referencePower = 1, referenceDistance = 1;
 
     while (true) {
-        fileStream >> currentToken; // point or endlights
+        currentToken = readToken(fileStream); // point or endlights
 
         if (currentToken == "reference") {
             for (int i = 0; i < 2; ++i) {
-                fileStream >> currentToken;
+                currentToken = readToken(fileStream);
                 if (currentToken == "power") {
                     fileStream >> referencePower;
                 }
@@ -129,7 +185,7 @@ void LoadFromRt::readLights(std::ifstream &fileStream, Scene &scene) {
                     fileStream >> referenceDistance;
                 }
             }
-            fileStream >> currentToken; // endreference
+            currentToken = readToken(fileStream); // endreference
             continue;
         }
         else if (currentToken == "endlights") {
@@ -140,7 +196,7 @@ void LoadFromRt::readLights(std::ifstream &fileStream, Scene &scene) {
         double power = 1;
 
         for (int i = 0; i < 2; ++i) {
-            fileStream >> currentToken;
+            currentToken = readToken(fileStream);
             if (currentToken == "coords") {
                 point = readPoint(fileStream);
             }
@@ -148,26 +204,35 @@ void LoadFromRt::readLights(std::ifstream &fileStream, Scene &scene) {
                 fileStream >> power;
             }
         }
-        fileStream >> currentToken; // endpoint
+        currentToken = readToken(fileStream); // endpoint
 
         scene.addLightSource(LightSource(point, power / referencePower * referenceDistance * referenceDistance));
     }
 }
 
-void LoadFromRt::readGeometry(std::ifstream &fileStream, Scene &scene, std::map<std::string, Material> &materials) {
+void LoadFromRt::readGeometry(std::ifstream &fileStream, Scene &scene, std::map<std::string, Material> &materials,
+                              const std::string &directory, const std::string &cacheDirectory) {
     std::string currentToken;
+    std::map<std::string, TriangleMesh *> meshes; // triangles are grouped by material
+    std::map<std::string, InstancedMesh *> instancedMeshes;
 
     while (true) {
-        fileStream >> currentToken; // point or endlights
+        currentToken = readToken(fileStream); // point or endlights
 
         if (currentToken == "sphere") {
             readSphere(fileStream, scene, materials);
         }
         else if (currentToken == "triangle") {
-            readTriangle(fileStream, scene, materials);
+            readTriangle(fileStream, scene, materials, meshes);
         }
         else if (currentToken == "quadrangle") {
             readQuadrangle(fileStream, scene, materials);
+        }
+        else if (currentToken == "mesh") {
+            readMesh(fileStream, scene, materials, directory, cacheDirectory, instancedMeshes);
+        }
+        else if (currentToken == "instance") {
+            readInstance(fileStream, scene, materials, instancedMeshes);
         } else { // endgeometry
             break;
         }
@@ -181,7 +246,7 @@ void LoadFromRt::readSphere(std::ifstream &fileStream, Scene &scene, std::map<st
     std::string materialName;
 
     for (int i = 0; i < 3; ++i) {
-        fileStream >> currentToken;
+        currentToken = readToken(fileStream);
         if (currentToken == "coords") {
             center = readPoint(fileStream);
         }
@@ -192,18 +257,19 @@ void LoadFromRt::readSphere(std::ifstream &fileStream, Scene &scene, std::map<st
             fileStream >> materialName;
         }
     }
-    fileStream >> currentToken; // endsphere
+    currentToken = readToken(fileStream); // endsphere
 
-    scene.addObject(new Sphere(center, radius, materials[materialName]));
+    scene.createObject<Sphere>(center, radius, materials[materialName]);
 }
 
-void LoadFromRt::readTriangle(std::ifstream &fileStream, Scene &scene, std::map<std::string, Material> &materials) {
+void LoadFromRt::readTriangle(std::ifstream &fileStream, Scene &scene, std::map<std::string, Material> &materials,
+                              std::map<std::string, TriangleMesh *> &meshes) {
     std::string currentToken;
     std::vector<Point> vertices;
     std::string materialName;
 
     for (int i = 0; i < 4; ++i) {
-        fileStream >> currentToken;
+        currentToken = readToken(fileStream);
         if (currentToken == "vertex") {
             vertices.push_back(readPoint(fileStream));
         }
@@ -211,9 +277,13 @@ void LoadFromRt::readTriangle(std::ifstream &fileStream, Scene &scene, std::map<
             fileStream >> materialName;
         }
     }
-    fileStream >> currentToken; // endtriangle
+    currentToken = readToken(fileStream); // endtriangle
 
-    scene.addObject(new Triangle(vertices[0], vertices[1], vertices[2], materials[materialName]));
+    TriangleMesh *&mesh = meshes[materialName];
+    if (mesh == nullptr) {
+        mesh = scene.createObject<TriangleMesh>(materials[materialName]);
+    }
+    mesh->addTriangle(vertices[0], vertices[1], vertices[2]);
 }
 
 void LoadFromRt::readQuadrangle(std::ifstream &fileStream, Scene &scene, std::map<std::string, Material> &materials) {
@@ -222,7 +292,7 @@ void LoadFromRt::readQuadrangle(std::ifstream &fileStream, Scene &scene, std::ma
     std::string materialName;
 
     for (int i = 0; i < 5; ++i) {
-        fileStream >> currentToken;
+        currentToken = readToken(fileStream);
         if (currentToken == "vertex") {
             vertices.push_back(readPoint(fileStream));
         }
@@ -230,24 +300,94 @@ void LoadFromRt::readQuadrangle(std::ifstream &fileStream, Scene &scene, std::ma
             fileStream >> materialName;
         }
     }
-    fileStream >> currentToken; // endquadrangle
+    currentToken = readToken(fileStream); // endquadrangle
 
-    scene.addObject(new Polygon(vertices, materials[materialName]));
+    scene.createObject<Polygon>(vertices, materials[materialName]);
 }
 
+// Mesh for instances: a name, a material and an STL file or triangles given by their vertices
+void LoadFromRt::readMesh(std::ifstream &fileStream, Scene &scene, std::map<std::string, Material> &materials,
+                          const std::string &directory, const std::string &cacheDirectory,
+                          std::map<std::string, InstancedMesh *> &instancedMeshes) {
+    std::string currentToken;
+    std::string name, materialName, meshFile;
+    std::vector<Point> vertices;
 
+    while (true) {
+        currentToken = readToken(fileStream);
+        if (currentToken == "endmesh") {
+            break;
+        }
+        else if (currentToken == "name") {
+            fileStream >> name;
+        }
+        else if (currentToken == "material") {
+            fileStream >> materialName;
+        }
+        else if (currentToken == "file") {
+            fileStream >> meshFile;
+        }
+        else if (currentToken == "vertex") {
+            vertices.push_back(readPoint(fileStream));
+        }
+        else if (currentToken != "triangle" && currentToken != "endtriangle") { // they only group the vertices
+            throw std::runtime_error("unknown mesh property " + currentToken);
+        }
+    }
 
+    if (instancedMeshes.count(name) != 0) {
+        throw std::runtime_error("mesh " + name + " is defined twice");
+    }
+    InstancedMesh *mesh = scene.createInstancedMesh(materials[materialName]);
+    if (!meshFile.empty()) {
+        LoadFromStl::loadMesh(meshFile[0] == '/' ? meshFile : directory + meshFile, mesh->getMesh(),
+                              cacheDirectory);
+    }
+    for (size_t i = 0; i + 2 < vertices.size(); i += 3) {
+        mesh->getMesh().addTriangle(vertices[i], vertices[i + 1], vertices[i + 2]);
+    }
+    instancedMeshes[name] = mesh;
+}
 
+// The transforms are applied in the order they are written, the material of the mesh is used by default
+void LoadFromRt::readInstance(std::ifstream &fileStream, Scene &scene, std::map<std::string, Material> &materials,
+                              std::map<std::string, InstancedMesh *> &instancedMeshes) {
+    std::string currentToken;
+    std::string meshName, materialName;
+    Transform transform;
 
+    while (true) {
+        currentToken = readToken(fileStream);
+        if (currentToken == "endinstance") {
+            break;
+        }
+        else if (currentToken == "mesh") {
+            fileStream >> meshName;
+        }
+        else if (currentToken == "material") {
+            fileStream >> materialName;
+        }
+        else if (currentToken == "scale") {
+            transform = Transform::scale(readPoint(fileStream)) * transform;
+        }
+        else if (currentToken == "rotate") { // axis and angle in degrees
+            Vector axis = readPoint(fileStream);
+            double degrees = 0;
+            fileStream >> degrees;
+            transform = Transform::rotate(axis, degrees * std::acos(-1.0) / 180) * transform;
+        }
+        else if (currentToken == "translate") {
+            transform = Transform::translate(readPoint(fileStream)) * transform;
+        }
+        else {
+            throw std::runtime_error("unknown instance property " + currentToken);
+        }
+    }
 
-
-
-
-
-
-
-
-
-
-
-
+    auto mesh = instancedMeshes.find(meshName);
+    if (mesh == instancedMeshes.end()) {
+        throw std::runtime_error("unknown mesh " + meshName);
+    }
+    const Material &material = materialName.empty() ? mesh->second->getMesh().getMaterial() : materials[materialName];
+    scene.createObject<MeshInstance>(mesh->second, transform, material);
+}
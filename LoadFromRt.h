@@ -3,21 +3,36 @@
 
 
 #include <map>
+#include <vector>
 #include "Scene.h"
 #include "Render.h"
 
 class LoadFromRt {
+    static std::string readToken(std::ifstream &fileStream);
     static Point readPoint(std::ifstream &fileStream);
     static Color readColor(std::ifstream &fileStream);
     static Screen readViewport(std::ifstream &fileStream);
     static std::map<std::string, Material> readMaterials(std::ifstream &fileStream);
     static void readLights(std::ifstream &fileStream, Scene &scene);
-    static void readGeometry(std::ifstream &fileStream, Scene &scene, std::map<std::string, Material> &materials);
+    static void readGeometry(std::ifstream &fileStream, Scene &scene, std::map<std::string, Material> &materials,
+                             const std::string &directory, const std::string &cacheDirectory);
     static void readSphere(std::ifstream &fileStream, Scene &scene, std::map<std::string, Material> &materials);
-    static void readTriangle(std::ifstream &fileStream, Scene &scene, std::map<std::string, Material> &materials);
+    static void readTriangle(std::ifstream &fileStream, Scene &scene, std::map<std::string, Material> &materials,
+                             std::map<std::string, TriangleMesh *> &meshes);
     static void readQuadrangle(std::ifstream &fileStream, Scene &scene, std::map<std::string, Material> &materials);
+    static void readMesh(std::ifstream &fileStream, Scene &scene, std::map<std::string, Material> &materials,
+                         const std::string &directory, const std::string &cacheDirectory,
+                         std::map<std::string, InstancedMesh *> &instancedMeshes);
+    static void readInstance(std::ifstream &fileStream, Scene &scene, std::map<std::string, Material> &materials,
+                             std::map<std::string, InstancedMesh *> &instancedMeshes);
 public:
-    static void load(const std::string &filePath, Scene &scene, Screen &screen);
+    // Throws std::runtime_error if the file can't be opened, ends too early or places an unknown mesh.
+    // The mesh files are loaded through the cache in cacheDirectory unless it is empty.
+    static void load(const std::string &filePath, Scene &scene, Screen &screen,
+                     const std::string &cacheDirectory = "");
+    // Reads a file of viewport ... endviewport blocks, one view for each.
+    // Throws std::runtime_error if the file can't be opened, has anything else in it or no views.
+    static std::vector<Screen> loadViews(const std::string &filePath);
 };
 
 
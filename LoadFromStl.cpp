@@ -1,53 +1,289 @@
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#include "KDTreeCache.h"
 #include "LoadFromStl.h"
+#include "MappedFile.h"
+#include "Statistics.h"
+
+namespace {
+    const size_t binaryHeaderSize = 84;  // 80 bytes of text and the facets count
+    const size_t binaryFacetSize = 50;   // 12 floats and a 2-byte attribute
+
+    uint32_t readUint32(const char *data) {
+        const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+        return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (static_cast<uint32_t>(bytes[3]) << 24);
+    }
+
+    // binary STL is little-endian
+    float readFloat(const char *data) {
+        uint32_t bits = readUint32(data);
+        float value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    Point readBinaryPoint(const char *data) {
+        return Point(readFloat(data), readFloat(data + 4), readFloat(data + 8));
+    }
+
+    // Tokenizer over the file contents, no strings are allocated
+    class AsciiReader {
+        const char *position;
+        const char *end;
+        const std::string &filePath;
+
+        static bool isSpace(char c) {
+            return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+        }
+
+        static bool isDigit(char c) {
+            return c >= '0' && c <= '9';
+        }
+
+        void skipSpaces() {
+            while (position < end && isSpace(*position)) {
+                ++position;
+            }
+        }
+
+        // digits go to the mantissa while it has less than 19 of them, the rest only scale the exponent
+        void readDigits(const char *&p, uint64_t &mantissa, int &significantDigits, int &exponent, bool isFraction,
+                        bool &hasDigits) {
+            for (; p < end && isDigit(*p); ++p) {
+                hasDigits = true;
+                if (significantDigits < 19) {
+                    mantissa = mantissa * 10 + (*p - '0');
+                    if (mantissa != 0) {
+                        ++significantDigits;
+                    }
+                    if (isFraction) {
+                        --exponent;
+                    }
+                }
+                else if (!isFraction) {
+                    ++exponent;
+                }
+            }
+        }
+
+    public:
+        AsciiReader(const char *data, size_t size, const std::string &filePath) :
+                position(data), end(data + size), filePath(filePath) { }
+
+        void fail() const {
+            throw std::runtime_error("malformed STL file " + filePath);
+        }
+
+        bool isAtEnd() {
+            skipSpaces();
+            return position == end;
+        }
+
+        void skipLine() {
+            position = std::find(position, end, '\n');
+        }
+
+        bool readWord(const char *&word, size_t &length) {
+            skipSpaces();
+            word = position;
+            while (position < end && !isSpace(*position)) {
+                ++position;
+            }
+            length = position - word;
+            return length > 0;
+        }
 
-void LoadFromStl::load(const std::string &filePath,
-                       const Material &material,
-                       Scene &scene) {
-    std::ifstream fileStream(filePath);
+        bool isNextWord(const char *expected) {
+            const char *word;
+            size_t length;
+            return readWord(word, length) && length == std::strlen(expected) &&
+                   std::memcmp(word, expected, length) == 0;
+        }
+
+        void expectWord(const char *expected) {
+            if (!isNextWord(expected)) {
+                fail();
+            }
+        }
+
+        // Decimal number with an optional exponent. The result is exact for mantissas below 2^53
+        // and exponents up to 22, which covers the numbers written by STL exporters; it is also
+        // independent of the C locale, unlike strtod.
+        double readNumber() {
+            static const double powersOf10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                                1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+            skipSpaces();
+            const char *p = position;
+
+            bool negative = false;
+            if (p < end && (*p == '-' || *p == '+')) {
+                negative = *p == '-';
+                ++p;
+            }
+
+            uint64_t mantissa = 0;
+            int significantDigits = 0, exponent = 0;
+            bool hasDigits = false;
+            readDigits(p, mantissa, significantDigits, exponent, false, hasDigits);
+            if (p < end && *p == '.') {
+                ++p;
+                readDigits(p, mantissa, significantDigits, exponent, true, hasDigits);
+            }
+            if (!hasDigits) {
+                fail();
+            }
+
+            if (p < end && (*p == 'e' || *p == 'E')) {
+                ++p;
+                bool negativeExponent = false;
+                if (p < end && (*p == '-' || *p == '+')) {
+                    negativeExponent = *p == '-';
+                    ++p;
+                }
+                if (p == end || !isDigit(*p)) {
+                    fail();
+                }
+                int writtenExponent = 0;
+                for (; p < end && isDigit(*p); ++p) {
+                    writtenExponent = std::min(writtenExponent * 10 + (*p - '0'), 100000);
+                }
+                exponent += negativeExponent ? -writtenExponent : writtenExponent;
+            }
+            position = p;
+
+            double value = static_cast<double>(mantissa);
+            if (exponent < 0) {
+                value /= -exponent <= 22 ? powersOf10[-exponent] : std::pow(10.0, -exponent);
+            }
+            else if (exponent > 0) {
+                value *= exponent <= 22 ? powersOf10[exponent] : std::pow(10.0, exponent);
+            }
+            return negative ? -value : value;
+        }
+
+        Point readPoint() {
+            double x = readNumber();
+            double y = readNumber();
+            double z = readNumber();
+            return Point(x, y, z);
+        }
+    };
+}
+
+// Binary files begin with 80 arbitrary bytes, which may also start with "solid",
+// so a file is binary when its size matches the facets count in the header
+bool LoadFromStl::isBinary(const char *data, size_t size) {
+    if (size < binaryHeaderSize) {
+        return false;
+    }
+    uint64_t facetsCount = readUint32(data + 80);
+    if (size == binaryHeaderSize + facetsCount * binaryFacetSize) {
+        return true;
+    }
+
+    const char *text = data;
+    while (text < data + size && std::isspace(static_cast<unsigned char>(*text))) {
+        ++text;
+    }
+    bool startsWithSolid = data + size - text >= 5 && std::memcmp(text, "solid", 5) == 0;
+    return !startsWithSolid && size >= binaryHeaderSize + facetsCount * binaryFacetSize;
+}
 
-    if (!fileStream.good()) {
-        throw "file opening error";
+void LoadFromStl::loadBinary(const char *data, size_t size, const std::string &filePath, TriangleMesh &mesh) {
+    size_t facetsCount = readUint32(data + 80);
+    if (size < binaryHeaderSize + facetsCount * binaryFacetSize) {
+        throw std::runtime_error("truncated STL file " + filePath);
     }
 
-    std::string currentToken;
+    mesh.reserve(facetsCount);
+    const char *facet = data + binaryHeaderSize;
+    for (size_t i = 0; i < facetsCount; ++i, facet += binaryFacetSize) {
+        mesh.addTriangle(readBinaryPoint(facet + 12), readBinaryPoint(facet + 24), readBinaryPoint(facet + 36),
+                         readBinaryPoint(facet));
+    }
+}
 
-    fileStream >> currentToken; // facet or endsolid
-    fileStream >> currentToken; // facet or endsolid
+void LoadFromStl::loadAscii(const char *data, size_t size, const std::string &filePath, TriangleMesh &mesh) {
+    // facets are usually written in 7 lines
+    mesh.reserve(std::count(data, data + size, '\n') / 7 + 1);
 
-    while (true) {
-        fileStream >> currentToken; // facet or endsolid
+    AsciiReader reader(data, size, filePath);
+    reader.expectWord("solid");
+    reader.skipLine(); // name
 
-        if (currentToken == "endsolid") {
+    while (!reader.isAtEnd()) {
+        const char *word;
+        size_t length;
+        reader.readWord(word, length);
+        if (length == 8 && std::memcmp(word, "endsolid", 8) == 0) {
             break;
         }
-        else if (currentToken == "") {
-            continue;
+        if (length != 5 || std::memcmp(word, "facet", 5) != 0) {
+            reader.fail();
         }
 
-        double nX, nY, nZ;
-        fileStream >> currentToken; // normal
-        fileStream >> nX >> nY >> nZ;
+        reader.expectWord("normal");
+        Vector normal = reader.readPoint();
 
-        fileStream >> currentToken; // outer
-        fileStream >> currentToken; // loop
+        reader.expectWord("outer");
+        reader.expectWord("loop");
+        Point vertices[3];
+        for (int i = 0; i < 3; ++i) {
+            reader.expectWord("vertex");
+            vertices[i] = reader.readPoint();
+        }
+        reader.expectWord("endloop");
+        reader.expectWord("endfacet");
+
+        mesh.addTriangle(vertices[0], vertices[1], vertices[2], normal);
+    }
+}
 
-        double v1X, v1Y, v1Z;
-        fileStream >> currentToken; // vertex
-        fileStream >> v1X >> v1Y >> v1Z;
-        double v2X, v2Y, v2Z;
-        fileStream >> currentToken; // vertex
-        fileStream >> v2X >> v2Y >> v2Z;
-        double v3X, v3Y, v3Z;
-        fileStream >> currentToken; // vertex
-        fileStream >> v3X >> v3Y >> v3Z;
+StlLoadStats LoadFromStl::load(const std::string &filePath, const Material &material, Scene &scene,
+                               const std::string &cacheDirectory) {
+    return loadMesh(filePath, *scene.createObject<TriangleMesh>(material), cacheDirectory);
+}
 
-        fileStream >> currentToken; // endloop
-        fileStream >> currentToken; // endfacet
+StlLoadStats LoadFromStl::loadMesh(const std::string &filePath, TriangleMesh &mesh,
+                                   const std::string &cacheDirectory) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    PhaseTimer timer(Statistics::Parse);
 
-        scene.addObject(
-                new Triangle(Point(v1X, v1Y, v1Z), Point(v2X, v2Y, v2Z), Point(v3X, v3Y, v3Z), Vector(nX, nY, nZ),
-                             material));
+    MappedFile file(filePath);
+    size_t initialTrianglesCount = mesh.getTrianglesCount();
+
+    StlLoadStats stats;
+    stats.isBinary = isBinary(file.getData(), file.getSize());
+    // binary files are read in a single pass over the mapping, which the cache can't beat,
+    // and only a mesh loaded on its own can be mapped from it
+    uint64_t cacheKey = 0;
+    bool useCache = !cacheDirectory.empty() && !stats.isBinary && initialTrianglesCount == 0 &&
+                    KDTreeCache::getFileKey(filePath, cacheKey);
+    if (useCache) {
+        stats.isCached = KDTreeCache::loadMesh(mesh, cacheDirectory, cacheKey);
+    }
+
+    if (!stats.isCached) {
+        if (stats.isBinary) {
+            loadBinary(file.getData(), file.getSize(), filePath, mesh);
+        }
+        else {
+            loadAscii(file.getData(), file.getSize(), filePath, mesh);
+        }
+        // a cache that can't be written only costs the next run the parsing
+        if (useCache) {
+            KDTreeCache::saveMesh(mesh, cacheDirectory, cacheKey);
+        }
     }
 
-    fileStream.close();
-}
\ No newline at end of file
+    stats.facetsCount = mesh.getTrianglesCount() - initialTrianglesCount;
+    stats.bytesCount = file.getSize();
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return stats;
+}
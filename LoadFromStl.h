@@ -1,13 +1,43 @@
 #ifndef RAYTRACING_LOADFROMSTL_H
 #define RAYTRACING_LOADFROMSTL_H
 
-#include <fstream>
+#include <string>
 
 #include "Scene.h"
 
+struct StlLoadStats {
+    StlLoadStats() : isBinary(false), isCached(false), facetsCount(0), bytesCount(0), seconds(0) { }
+
+    bool isBinary;
+    bool isCached;      // the triangles were copied from the cache instead of being parsed
+    size_t facetsCount;
+    size_t bytesCount;
+    double seconds;
+
+    // megabytes per second
+    double getThroughput() const {
+        return seconds > 0 ? bytesCount / seconds / 1e6 : 0;
+    }
+};
+
 class LoadFromStl {
+    static bool isBinary(const char *data, size_t size);
+
+    static void loadBinary(const char *data, size_t size, const std::string &filePath, TriangleMesh &mesh);
+
+    static void loadAscii(const char *data, size_t size, const std::string &filePath, TriangleMesh &mesh);
+
 public:
-    static void load(const std::string &filePath, const Material &material, Scene &scene);
+    // Loads an ASCII or a binary STL file into one mesh, the format is detected from the contents.
+    // The triangles parsed from an ASCII file are kept in cacheDirectory and reused while the file stays the same,
+    // an empty directory disables the cache.
+    // Throws std::runtime_error if the file can't be read or is malformed.
+    static StlLoadStats load(const std::string &filePath, const Material &material, Scene &scene,
+                             const std::string &cacheDirectory = "");
+
+    // the same into the given mesh, as a mesh shared by instances
+    static StlLoadStats loadMesh(const std::string &filePath, TriangleMesh &mesh,
+                                 const std::string &cacheDirectory = "");
 };
 
 
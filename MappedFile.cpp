@@ -0,0 +1,65 @@
+#include <stdexcept>
+
+#include "MappedFile.h"
+
+#ifdef RAYTRACING_MMAP
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string &filePath, bool isSequential) : data(nullptr), size(0) {
+    int file = open(filePath.c_str(), O_RDONLY);
+    if (file < 0) {
+        throw std::runtime_error("can't open " + filePath);
+    }
+
+    struct stat fileStat;
+    if (fstat(file, &fileStat) != 0) {
+        close(file);
+        throw std::runtime_error("can't read " + filePath);
+    }
+    size = static_cast<size_t>(fileStat.st_size);
+
+    // an empty file can't be mapped, it is left with null data
+    if (size > 0) {
+        void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (mapping == MAP_FAILED) {
+            close(file);
+            throw std::runtime_error("can't map " + filePath);
+        }
+        madvise(mapping, size, isSequential ? MADV_SEQUENTIAL : MADV_NORMAL);
+        data = static_cast<const char *>(mapping);
+    }
+    close(file);
+}
+
+MappedFile::~MappedFile() {
+    if (data != nullptr) {
+        munmap(const_cast<char *>(data), size);
+    }
+}
+
+#else
+
+#include <fstream>
+
+MappedFile::MappedFile(const std::string &filePath, bool) : data(nullptr), size(0) {
+    std::ifstream fileStream(filePath, std::ios::binary | std::ios::ate);
+    if (!fileStream.good()) {
+        throw std::runtime_error("can't open " + filePath);
+    }
+
+    buffer.resize(static_cast<size_t>(fileStream.tellg()));
+    fileStream.seekg(0);
+    if (!fileStream.read(buffer.data(), buffer.size())) {
+        throw std::runtime_error("can't read " + filePath);
+    }
+    data = buffer.data();
+    size = buffer.size();
+}
+
+MappedFile::~MappedFile() { }
+
+#endif
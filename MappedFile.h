@@ -0,0 +1,37 @@
+#ifndef RAYTRACING_MAPPEDFILE_H
+#define RAYTRACING_MAPPEDFILE_H
+
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RAYTRACING_MMAP
+#endif
+
+// Read-only contents of a whole file. The file is memory mapped where the system supports it,
+// otherwise it is read into a buffer.
+class MappedFile {
+    const char *data;
+    size_t size;
+#ifndef RAYTRACING_MMAP
+    std::vector<char> buffer;
+#endif
+
+public:
+    // Throws std::runtime_error if the file can't be read.
+    // Files read from the beginning to the end are marked sequential, so they are read ahead aggressively.
+    explicit MappedFile(const std::string &filePath, bool isSequential = true);
+
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const char *getData() const { return data; }
+
+    size_t getSize() const { return size; }
+};
+
+
+#endif //RAYTRACING_MAPPEDFILE_H
@@ -1,25 +1,37 @@
 #ifndef RAYTRACING_COLOR_H
 #define RAYTRACING_COLOR_H
 
-#include <QRgb>
+#include <algorithm>
+#include <cmath>
+
+#include "Real.h"
 
 class Color {
-    double r, g, b;
+    Real r, g, b;
 
 public:
     Color() = default;
 
-    Color(double r, double g, double b) : r(r), g(g), b(b) { }
+    Color(Real r, Real g, Real b) : r(r), g(g), b(b) { }
+
+    Real getRed() const { return r; }
+
+    Real getGreen() const { return g; }
+
+    Real getBlue() const { return b; }
 
-    QRgb toQRgb() const {
-        return qRgb(std::min(255.0, r * 255), std::min(255.0, g * 255), std::min(255.0, b * 255));
+    // the largest difference of the channels as they are shown, the channels above 1 are shown as 1
+    Real getDifference(const Color &c) const {
+        auto shown = [](Real channel) { return std::min<Real>(1, std::max<Real>(0, channel)); };
+        return std::max({std::abs(shown(r) - shown(c.r)), std::abs(shown(g) - shown(c.g)),
+                         std::abs(shown(b) - shown(c.b))});
     }
 
-    friend Color operator*(double m, const Color &c) {
+    friend Color operator*(Real m, const Color &c) {
         return Color(m * c.r, m * c.g, m * c.b);
     }
 
-    friend Color operator*(const Color &c, double m) {
+    friend Color operator*(const Color &c, Real m) {
         return Color(m * c.r, m * c.g, m * c.b);
     }
 
@@ -30,24 +42,24 @@ public:
 
 class Material {
     Color color;
-    double reflect;
-    double refract;
+    Real reflect;
+    Real refract;
 
 public:
     Material() = default;
 
-    Material(const Color &color, double reflect, double refract) :
+    Material(const Color &color, Real reflect, Real refract) :
             color(color), reflect(reflect), refract(refract) { }
 
     const Color &getColor() const {
         return color;
     }
 
-    double getReflect() const {
+    Real getReflect() const {
         return reflect;
     }
 
-    double getRefract() const {
+    Real getRefract() const {
         return refract;
     }
 };
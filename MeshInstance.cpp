@@ -0,0 +1,49 @@
+#include "MeshInstance.h"
+
+void InstancedMesh::buildTree(const KDTreeSettings &settings) {
+    tree.buildTree({&mesh}, settings);
+    box = mesh.getBoundingBox();
+    isBuilt = true;
+}
+
+bool MeshInstance::findHit(const Point &rayStart, const Vector &rayDirection, Hit &hit) const {
+    uint32_t element;
+    if (!mesh->getTree().findNearestHit(toMesh.transformPoint(rayStart), toMesh.transformVector(rayDirection), hit,
+                                        element)) {
+        return false;
+    }
+    hit.element = element;
+    return true;
+}
+
+// the instance has its own material, the mesh only gives the geometry and the face of the hit
+void MeshInstance::getIntersection(const Point &rayStart, const Vector &rayDirection, const Hit &hit,
+                                   Intersection &intersection) const {
+    mesh->getTree().getIntersection(hit.element, toMesh.transformPoint(rayStart),
+                                    toMesh.transformVector(rayDirection), hit, intersection);
+
+    intersection.surfaceNormal = UnitVector(toMesh.transformNormal(intersection.surfaceNormal));
+    intersection.point = rayStart + rayDirection * hit.t;
+    intersection.distance = (intersection.point - rayStart).length();
+    intersection.color = intersection.isFrontFace ? getMaterial().getColor() : Color(0x00, 0x00, 0x00);
+    intersection.primitive = this;
+}
+
+BoundingBox MeshInstance::getBoundingBox() const {
+    BoundingBox meshBox = mesh->getBoundingBox();
+    const Point *corners[2] = {&meshBox.minCorner, &meshBox.maxCorner};
+
+    BoundingBox box;
+    for (int i = 0; i < 8; ++i) {
+        Point corner = toWorld.transformPoint(Point(corners[i & 1]->getX(), corners[(i >> 1) & 1]->getY(),
+                                                    corners[i >> 2]->getZ()));
+        if (i == 0) {
+            box = BoundingBox(corner, corner);
+        }
+        else {
+            box.minCorner = BoundingBox::uniteMinCorners(box.minCorner, corner);
+            box.maxCorner = BoundingBox::uniteMaxCorners(box.maxCorner, corner);
+        }
+    }
+    return box;
+}
@@ -0,0 +1,56 @@
+#ifndef RAYTRACING_MESHINSTANCE_H
+#define RAYTRACING_MESHINSTANCE_H
+
+#include "KDTree.h"
+#include "Primitives.h"
+#include "Transform.h"
+
+// Mesh which isn't an object of the scene itself but is placed there by any number of instances.
+// It gets its own tree, which all of them share.
+class InstancedMesh {
+    TriangleMesh mesh;
+    KDTree tree;
+    BoundingBox box;
+    bool isBuilt;
+
+public:
+    InstancedMesh(const Material &material) : mesh(material), isBuilt(false) { }
+
+    TriangleMesh &getMesh() { return mesh; }
+
+    const TriangleMesh &getMesh() const { return mesh; }
+
+    void buildTree(const KDTreeSettings &settings);
+
+    const KDTree &getTree() const { return tree; }
+
+    // kept since the tree is built, the instances ask for it when the scene tree is built
+    BoundingBox getBoundingBox() const { return isBuilt ? box : mesh.getBoundingBox(); }
+};
+
+// Copy of a shared mesh moved by a transform. Rays are moved into the space of the mesh, where the position
+// along the ray stays the same, and traced through the tree of the mesh, so the scene tree only has
+// one element per instance and an instance takes the same memory whatever the size of the mesh.
+class MeshInstance : public Primitive {
+    const InstancedMesh *mesh;
+    Transform toMesh;
+    Transform toWorld;
+
+public:
+    MeshInstance(const InstancedMesh *mesh, const Transform &transform, const Material &material) :
+            Primitive(material), mesh(mesh), toMesh(transform.getInverse()), toWorld(transform) { }
+
+    virtual bool intersectWithRay(Point rayStart, Vector rayDirection, Intersection &intersection) const {
+        return intersectByHit(rayStart, rayDirection, intersection);
+    }
+
+    bool findHit(const Point &rayStart, const Vector &rayDirection, Hit &hit) const;
+
+    void getIntersection(const Point &rayStart, const Vector &rayDirection, const Hit &hit,
+                         Intersection &intersection) const;
+
+    BoundingBox getBoundingBox() const;
+};
+
+
+#endif //RAYTRACING_MESHINSTANCE_H
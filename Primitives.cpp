@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <limits>
+
 #include "Primitives.h"
 
 Triangle::Triangle(const Point &A, const Point &B, const Point &C, const Vector &normal, const Material &material) :
@@ -14,12 +17,27 @@ Triangle::Triangle(const Point &A, const Point &B, const Point &C, const Vector
     }
 }
 
-bool Triangle::intersectWithRay(Point rayStart, Vector rayDirection, Intersection &intersection) {
+bool Primitive::findHit(const Point &rayStart, const Vector &rayDirection, Hit &hit) const {
+    Intersection intersection;
+    if (!intersectWithRay(rayStart, rayDirection, intersection)) {
+        return false;
+    }
+    hit.t = intersection.distance / rayDirection.length();
+    return true;
+}
+
+void Primitive::getIntersection(const Point &rayStart, const Vector &rayDirection, const Hit &hit,
+                                Intersection &intersection) const {
+    intersectWithRay(rayStart, rayDirection, intersection);
+}
+
+
+bool Triangle::findHit(const Point &rayStart, const Vector &rayDirection, Hit &hit) const {
 
     Point rayPoint = rayStart + rayDirection;
 
-    double V1 = mixedProduct(A - rayStart, B - rayStart, C - rayStart);
-    double V2 = mixedProduct(A - rayPoint, B - rayPoint, C - rayPoint);
+    Real V1 = mixedProduct(A - rayStart, B - rayStart, C - rayStart);
+    Real V2 = mixedProduct(A - rayPoint, B - rayPoint, C - rayPoint);
 
     if (Point::doubleEqual(0, V1 - V2) || Point::doubleLessOrEqual(V1 / (V1 - V2), 0)) {
         return false;
@@ -34,21 +52,29 @@ bool Triangle::intersectWithRay(Point rayStart, Vector rayDirection, Intersectio
         return false;
     }
 
+    hit.t = V1 / (V1 - V2);
+    return true;
+}
+
+// the volume has the same sign as in findHit, so the side is the one the hit was found from
+void Triangle::getIntersection(const Point &rayStart, const Vector &rayDirection, const Hit &hit,
+                               Intersection &intersection) const {
+    Real V1 = mixedProduct(A - rayStart, B - rayStart, C - rayStart);
+    Point X = rayStart + rayDirection * hit.t;
+
     if (V1 > 0) {
         intersection.color = Color(0x00, 0x00, 0x00);
         intersection.isFrontFace = false;
-        intersection.surfaceNormal = ((B - A) * (C - A)).normalise(-1);
+        intersection.surfaceNormal = -UnitVector((B - A) * (C - A));
     }
     else {
         intersection.color = getMaterial().getColor();
         intersection.isFrontFace = true;
-        intersection.surfaceNormal = ((B - A) * (C - A)).normalise(1);
+        intersection.surfaceNormal = UnitVector((B - A) * (C - A));
     }
     intersection.point = X;
     intersection.distance = (X - rayStart).length();
     intersection.primitive = this;
-
-    return true;
 }
 
 BoundingBox Triangle::getBoundingBox() const {
@@ -62,6 +88,121 @@ BoundingBox Triangle::getBoundingBox() const {
 }
 
 
+void TriangleMesh::copyFromCache() {
+    BuiltCoordinates *built[3] = {&builtVertices, &builtEdges1, &builtEdges2};
+    const Coordinates *mapped[3] = {&vertices, &edges1, &edges2};
+    for (int i = 0; i < 3; ++i) {
+        built[i]->x.assign(mapped[i]->x, mapped[i]->x + trianglesCount);
+        built[i]->y.assign(mapped[i]->y, mapped[i]->y + trianglesCount);
+        built[i]->z.assign(mapped[i]->z, mapped[i]->z + trianglesCount);
+    }
+    cacheFile.reset();
+}
+
+// the pointers are taken again, as the arrays may have been reallocated
+void TriangleMesh::reserve(size_t trianglesCount) {
+    if (cacheFile) {
+        copyFromCache();
+    }
+    builtVertices.reserve(trianglesCount);
+    builtEdges1.reserve(trianglesCount);
+    builtEdges2.reserve(trianglesCount);
+    vertices = builtVertices.getCoordinates();
+    edges1 = builtEdges1.getCoordinates();
+    edges2 = builtEdges2.getCoordinates();
+}
+
+void TriangleMesh::addTriangle(const Point &A, const Point &B, const Point &C) {
+    if (cacheFile) {
+        copyFromCache();
+    }
+    builtVertices.push_back(A);
+    builtEdges1.push_back(B - A);
+    builtEdges2.push_back(C - A);
+    vertices = builtVertices.getCoordinates();
+    edges1 = builtEdges1.getCoordinates();
+    edges2 = builtEdges2.getCoordinates();
+    ++trianglesCount;
+}
+
+// a zero normal, which binary STL files often have, keeps the order of the vertices
+void TriangleMesh::addTriangle(const Point &A, const Point &B, const Point &C, const Vector &normal) {
+    if ((B - A) * (C - A) % normal < 0) {
+        addTriangle(A, C, B);
+    }
+    else {
+        addTriangle(A, B, C);
+    }
+}
+
+bool TriangleMesh::intersectWithRay(Point rayStart, Vector rayDirection, Intersection &intersection) const {
+    size_t nearestElement = 0;
+    Hit nearestHit;
+    nearestHit.t = std::numeric_limits<Real>::infinity();
+
+    for (size_t i = 0; i < getTrianglesCount(); ++i) {
+        Hit hit;
+        if (findElementHit(i, rayStart, rayDirection, hit) && hit.t < nearestHit.t) {
+            nearestHit = hit;
+            nearestElement = i;
+        }
+    }
+
+    if (nearestHit.t == std::numeric_limits<Real>::infinity()) {
+        return false;
+    }
+    getElementIntersection(nearestElement, rayStart, rayDirection, nearestHit, intersection);
+    return true;
+}
+
+void TriangleMesh::getElementIntersection(size_t element, const Point &rayStart, const Vector &rayDirection,
+                                          const Hit &hit, Intersection &intersection) const {
+    Vector edge1 = edges1[element];
+    Vector edge2 = edges2[element];
+    Real det = edge1 % (rayDirection * edge2);
+
+    Vector normal = edge1 * edge2;
+    if (det > 0) {
+        intersection.color = getMaterial().getColor();
+        intersection.isFrontFace = true;
+        intersection.surfaceNormal = UnitVector(normal);
+    }
+    else {
+        intersection.color = Color(0x00, 0x00, 0x00);
+        intersection.isFrontFace = false;
+        intersection.surfaceNormal = -UnitVector(normal);
+    }
+    intersection.point = rayStart + rayDirection * hit.t;
+    intersection.distance = (intersection.point - rayStart).length();
+    intersection.primitive = this;
+    intersection.element = static_cast<uint32_t>(element);
+}
+
+BoundingBox TriangleMesh::getElementBoundingBox(size_t element) const {
+    Point A = vertices[element];
+    Point B = A + edges1[element];
+    Point C = A + edges2[element];
+
+    return BoundingBox(BoundingBox::uniteMinCorners(A, BoundingBox::uniteMinCorners(B, C)),
+                       BoundingBox::uniteMaxCorners(A, BoundingBox::uniteMaxCorners(B, C)));
+}
+
+BoundingBox TriangleMesh::getBoundingBox() const {
+    if (getTrianglesCount() == 0) {
+        return BoundingBox(Point(0, 0, 0), Point(0, 0, 0));
+    }
+
+    BoundingBox box = getElementBoundingBox(0);
+    for (size_t i = 1; i < getTrianglesCount(); ++i) {
+        BoundingBox triangleBox = getElementBoundingBox(i);
+        box.minCorner = BoundingBox::uniteMinCorners(box.minCorner, triangleBox.minCorner);
+        box.maxCorner = BoundingBox::uniteMaxCorners(box.maxCorner, triangleBox.maxCorner);
+    }
+
+    return box;
+}
+
+
 Polygon::Polygon(const std::vector<Point> points, const Vector &normal, const Material &material) : Primitive(
         material) {
     if ((points[1] - points[0]) * (points[2] - points[0]) % normal > 0) {
@@ -71,51 +212,68 @@ Polygon::Polygon(const std::vector<Point> points, const Vector &normal, const Ma
         this->points = points;
         std::reverse(this->points.begin(), this->points.end());
     }
+    prepare();
 }
 
+void Polygon::prepare() {
+    normal = (points[1] - points[0]) * (points[2] - points[0]);
+    unitNormal = UnitVector(normal);
+    planeOffset = points[0] % normal;
+
+    edges.clear();
+    for (size_t i = 0; i < points.size(); ++i) {
+        const Point &start = points[i];
+        Vector edge = points[(i + 1) % points.size()] - start;
+        Vector inward = normal * edge;
+        Real scale = (points[(i + 2) % points.size()] - start) % inward / normal.squaredLength();
+
+        Edge prepared;
+        prepared.normal = inward * scale;
+        prepared.offset = start % prepared.normal;
+        edges.push_back(prepared);
+    }
+}
 
-bool Polygon::intersectWithRay(Point rayStart, Vector rayDirection, Intersection &intersection) {
-    Point A = points[0];
-    Point B = points[1];
-    Point C = points[2];
-    Point rayPoint = rayStart + rayDirection;
 
-    double V1 = mixedProduct(A - rayStart, B - rayStart, C - rayStart);
-    double V2 = mixedProduct(A - rayPoint, B - rayPoint, C - rayPoint);
+// the volumes of the triangle test are (A - rayStart) % normal and the same for the end of rayDirection
+bool Polygon::findHit(const Point &rayStart, const Vector &rayDirection, Hit &hit) const {
+    Real V1 = planeOffset - rayStart % normal;
+    Real volumesDifference = rayDirection % normal;
 
-    if (Point::doubleEqual(0, V1 - V2) || Point::doubleLessOrEqual(V1 / (V1 - V2), 0)) {
+    if (Point::doubleEqual(0, volumesDifference) || Point::doubleLessOrEqual(V1 / volumesDifference, 0)) {
         return false;
     }
 
-    Point X = rayStart + rayDirection * (V1 / (V1 - V2));
+    Real t = V1 / volumesDifference;
+    Point X = rayStart + rayDirection * t;
 
-    bool flag = true;
-    for (size_t i = 0; i < points.size() && flag; ++i) {
-        if (Point::doubleGreater(0, ((points[(i + 1) % points.size()] - points[i]) * (X - points[i])) %
-                                    ((points[(i + 1) % points.size()] - points[i]) *
-                                     (points[(i + 2) % points.size()] - points[i])))) {
-            flag = false;
+    for (const Edge &edge : edges) {
+        if (Point::doubleGreater(edge.offset, X % edge.normal)) {
+            return false;
         }
     }
-    if (!flag) {
-        return false;
-    }
 
-    if (V1 > 0) {
+    hit.t = t;
+    return true;
+}
+
+void Polygon::getIntersection(const Point &rayStart, const Vector &rayDirection, const Hit &hit,
+                              Intersection &intersection) const {
+    Point X = rayStart + rayDirection * hit.t;
+
+    if (planeOffset - rayStart % normal > 0) {
         intersection.color = Color(0x00, 0x00, 0x00);
         intersection.isFrontFace = false;
-        intersection.surfaceNormal = ((B - A) * (C - A)).normalise(-1);
+        intersection.surfaceNormal = -unitNormal;
     }
     else {
         intersection.color = getMaterial().getColor();
         intersection.isFrontFace = true;
-        intersection.surfaceNormal = ((B - A) * (C - A)).normalise(1);
+        intersection.surfaceNormal = unitNormal;
     }
     intersection.point = X;
     intersection.distance = (X - rayStart).length();
     intersection.primitive = this;
-
-    return true;
 }
 
 BoundingBox Polygon::getBoundingBox() const {
@@ -131,38 +289,24 @@ BoundingBox Polygon::getBoundingBox() const {
 }
 
 
-bool Sphere::intersectWithRay(Point rayStart, Vector rayDirection, Intersection &intersection) {
-
-    Point H = center.putHeight(rayStart, rayStart + rayDirection);
+// the ray going along the outward normal hits the sphere from the inside
+void Sphere::getIntersection(const Point &rayStart, const Vector &rayDirection, const Hit &hit,
+                             Intersection &intersection) const {
+    intersection.point = rayStart + rayDirection * hit.t;
+    intersection.distance = (intersection.point - rayStart).length();
 
-    if ((H - center).length() > radius) {
-        return false;
-    }
-
-    double chordLength = 2 * sqrt(radius * radius - (H - center).squaredLength());
-    intersection.distance = (H - rayStart) % rayDirection.normalise() - chordLength / 2;
-
-    if (Point::doubleLessOrEqual(intersection.distance, 0)) {
-        if (Point::doubleLessOrEqual(intersection.distance + chordLength, 0)) {
-            return false;
-        }
-        else {
-            intersection.distance += chordLength;
-            intersection.point = rayStart + rayDirection.normalise(intersection.distance);
-            intersection.surfaceNormal = (center - intersection.point).normalise();
-            intersection.color = Color(0x00, 0x00, 0x00);
-            intersection.isFrontFace = false;
-        }
+    Vector normal = intersection.point - center;
+    if (normal % rayDirection > 0) {
+        intersection.surfaceNormal = -UnitVector(normal);
+        intersection.color = Color(0x00, 0x00, 0x00);
+        intersection.isFrontFace = false;
     }
     else {
-        intersection.point = rayStart + rayDirection.normalise(intersection.distance);
-        intersection.surfaceNormal = (intersection.point - center).normalise();
+        intersection.surfaceNormal = UnitVector(normal);
         intersection.color = getMaterial().getColor();
         intersection.isFrontFace = true;
     }
     intersection.primitive = this;
-
-    return true;
 }
 
 
@@ -191,57 +335,27 @@ void BoundingBox::boundPrimitives(const std::vector<Primitive *> primitives) {
     }
 }
 
-bool BoundingBox::intersectsWithRay(const Point &rayStart, const Vector &rayDirection) const {
-    // corners
-    double dx = (maxCorner - minCorner).getX();
-    double dy = (maxCorner - minCorner).getY();
-    double dz = (maxCorner - minCorner).getZ();
-    Point A0 = minCorner;
-    Point B0 = minCorner + Vector(dx, 0, 0);
-    Point C0 = B0 + Vector(0, dy, 0);
-    Point D0 = A0 + Vector(0, dy, 0);
-    Point A1 = A0 + Vector(0, 0, dz);
-    Point B1 = B0 + Vector(0, 0, dz);
-    Point C1 = C0 + Vector(0, 0, dz);
-    Point D1 = D0 + Vector(0, 0, dz);
-
-    return isRayIntersectsWithSide(rayStart, rayDirection, A0, B0, C0, D0) ||
-           isRayIntersectsWithSide(rayStart, rayDirection, A1, B1, C1, D1) ||
-           isRayIntersectsWithSide(rayStart, rayDirection, A0, A1, D1, D0) ||
-           isRayIntersectsWithSide(rayStart, rayDirection, B0, B1, C1, C0) ||
-           isRayIntersectsWithSide(rayStart, rayDirection, A0, A1, B1, B0) ||
-           isRayIntersectsWithSide(rayStart, rayDirection, D0, D1, C1, C0);
-}
-
-bool BoundingBox::isRayIntersectsWithSide(const Point &rayStart, const Vector &rayDirection, const Point &A,
-                                          const Point &B, const Point &C, const Point &D) const {
-    Point rayPoint = rayStart + rayDirection;
+bool BoundingBox::intersectsWithRay(const Ray &ray, Real &tMin, Real &tMax) const {
+    const Point *bounds[2] = {&minCorner, &maxCorner};
 
-    double V1 = mixedProduct(A - rayStart, B - rayStart, C - rayStart);
-    double V2 = mixedProduct(A - rayPoint, B - rayPoint, C - rayPoint);
+    tMin = -std::numeric_limits<Real>::infinity();
+    tMax = std::numeric_limits<Real>::infinity();
+    for (int axis = 0; axis < 3; ++axis) {
+        Real start = ray.start.getCoordinate(axis);
+        Real inverseDirection = ray.inverseDirection.getCoordinate(axis);
+        Real slabMin = (bounds[ray.sign[axis]]->getCoordinate(axis) - start) * inverseDirection;
+        Real slabMax = (bounds[1 - ray.sign[axis]]->getCoordinate(axis) - start) * inverseDirection;
 
-    if (Point::doubleEqual(0, V1 - V2) || V1 / (V1 - V2) < 0) {
-        return false;
+        // written so that NaN from a ray lying in the slab plane leaves the interval unchanged
+        if (slabMin > tMin) {
+            tMin = slabMin;
+        }
+        if (slabMax < tMax) {
+            tMax = slabMax;
+        }
     }
 
-    Point X = rayStart + rayDirection * (V1 / (V1 - V2));
-
-    return Point::doubleLessOrEqual(minCorner.getX(), X.getX()) &&
-           Point::doubleLessOrEqual(X.getX(), maxCorner.getX()) &&
-           Point::doubleLessOrEqual(minCorner.getY(), X.getY()) &&
-           Point::doubleLessOrEqual(X.getY(), maxCorner.getY()) &&
-           Point::doubleLessOrEqual(minCorner.getZ(), X.getZ()) &&
-           Point::doubleLessOrEqual(X.getZ(), maxCorner.getZ());
+    // conservative rounding: flat boxes of planar primitives must not lose grazing hits
+    tMax *= 1 + 4 * std::numeric_limits<Real>::epsilon();
+    return tMin <= tMax && tMax >= 0;
 }
-
-
-
-
-
-
-
-
-
-
-
-
@@ -1,16 +1,35 @@
 #ifndef RAYTRACING_PRIMITIVES_H
 #define RAYTRACING_PRIMITIVES_H
 
+#include <cmath>
+#include <cstdint>
+#include <memory>
 #include <vector>
+#include "MappedFile.h"
 #include "Vector.h"
 #include "Material.h"
+#include "RayPacket.h"
 
 class Primitive;
+class KDTreeCache;
+
+// Ray with the data precomputed for bounding box tests
+struct Ray {
+    Ray(const Point &start, const Vector &direction) :
+            start(start), direction(direction),
+            inverseDirection(1 / direction.getX(), 1 / direction.getY(), 1 / direction.getZ()) {
+        sign[0] = inverseDirection.getX() < 0;
+        sign[1] = inverseDirection.getY() < 0;
+        sign[2] = inverseDirection.getZ() < 0;
+    }
 
-class BoundingBox {
-    bool isRayIntersectsWithSide(const Point &rayStart, const Vector &rayDirection, const Point &A,
-                                 const Point &B, const Point &C, const Point &D) const;
+    Point start;
+    Vector direction;
+    Vector inverseDirection;
+    int sign[3];
+};
 
+class BoundingBox {
 public:
     Point minCorner;
     Point maxCorner;
@@ -33,17 +52,24 @@ public:
 
     void boundPrimitives(const std::vector<Primitive *> primitives);
 
-    bool intersectsWithRay(const Point &rayStart, const Vector &rayDirection) const;
+    Real getSurfaceArea() const {
+        Vector size = maxCorner - minCorner;
+        return 2 * (size.getX() * size.getY() + size.getX() * size.getZ() + size.getY() * size.getZ());
+    }
+
+    // slab test, [tMin, tMax] is the part of the ray inside the box in units of ray.direction
+    bool intersectsWithRay(const Ray &ray, Real &tMin, Real &tMax) const;
 };
 
 struct Intersection {
     Intersection() = default;
 
     Point point;
-    double distance;
-    Vector surfaceNormal;
+    Real distance;
+    UnitVector surfaceNormal;
     Color color;
-    Primitive *primitive;
+    const Primitive *primitive;
+    uint32_t element;   // triangle of a mesh or of the mesh of an instance, 0 for the other primitives
     bool isFrontFace;
 
     bool operator<(const Intersection &intersection) const {
@@ -51,17 +77,58 @@ struct Intersection {
     }
 };
 
+// Hit kept while the nearest one is searched for, the surface data is computed only for the nearest hit
+struct Hit {
+    Real t;           // position along the ray in units of its direction
+    Real u, v;        // barycentric coordinates on mesh triangles
+    uint32_t element; // part of the primitives with a tree of their own
+};
+
 class Primitive {
     Material material;
 
 public:
     Primitive(const Material &material) : material(material) { }
 
-    virtual bool intersectWithRay(Point rayStart, Vector rayDirection, Intersection &intersection) = 0;
+    virtual ~Primitive() { }
+
+    virtual bool intersectWithRay(Point rayStart, Vector rayDirection, Intersection &intersection) const = 0;
+
+    // By default both go through intersectWithRay, the primitives of the scene replace them
+    // with a test which only finds the hit and the shading of the found hit
+    virtual bool findHit(const Point &rayStart, const Vector &rayDirection, Hit &hit) const;
+
+    virtual void getIntersection(const Point &rayStart, const Vector &rayDirection, const Hit &hit,
+                                 Intersection &intersection) const;
 
     const Material &getMaterial() const { return material; }
 
     virtual BoundingBox getBoundingBox() const = 0;
+
+    // Primitives consisting of several parts (meshes) give them to the tree as separate elements
+    virtual size_t getElementsCount() const { return 1; }
+
+    virtual BoundingBox getElementBoundingBox(size_t element) const { return getBoundingBox(); }
+
+    virtual bool findElementHit(size_t element, const Point &rayStart, const Vector &rayDirection, Hit &hit) const {
+        return findHit(rayStart, rayDirection, hit);
+    }
+
+    virtual void getElementIntersection(size_t element, const Point &rayStart, const Vector &rayDirection,
+                                        const Hit &hit, Intersection &intersection) const {
+        getIntersection(rayStart, rayDirection, hit, intersection);
+    }
+
+protected:
+    // intersectWithRay of the primitives which have findHit
+    bool intersectByHit(const Point &rayStart, const Vector &rayDirection, Intersection &intersection) const {
+        Hit hit;
+        if (!findHit(rayStart, rayDirection, hit)) {
+            return false;
+        }
+        getIntersection(rayStart, rayDirection, hit, intersection);
+        return true;
+    }
 };
 
 class Triangle : public Primitive {
@@ -73,34 +140,219 @@ public:
 
     Triangle(const Point &A, const Point &B, const Point &C, const Vector &normal, const Material &material);
 
-    virtual bool intersectWithRay(Point rayStart, Vector rayDirection, Intersection &intersection);
+    virtual bool intersectWithRay(Point rayStart, Vector rayDirection, Intersection &intersection) const {
+        return intersectByHit(rayStart, rayDirection, intersection);
+    }
+
+    bool findHit(const Point &rayStart, const Vector &rayDirection, Hit &hit) const;
+
+    void getIntersection(const Point &rayStart, const Vector &rayDirection, const Hit &hit,
+                         Intersection &intersection) const;
+
+    BoundingBox getBoundingBox() const;
+};
+
+// Triangles sharing one material. Vertices and edges are kept per coordinate
+// and intersected by the Moller-Trumbore algorithm.
+class TriangleMesh : public Primitive {
+    struct Coordinates {
+        const Real *x, *y, *z;
+
+        Vector operator[](size_t i) const { return Vector(x[i], y[i], z[i]); }
+    };
+
+    struct BuiltCoordinates {
+        std::vector<Real> x, y, z;
+
+        void reserve(size_t size) {
+            x.reserve(size);
+            y.reserve(size);
+            z.reserve(size);
+        }
+
+        void push_back(const Vector &v) {
+            x.push_back(v.getX());
+            y.push_back(v.getY());
+            z.push_back(v.getZ());
+        }
+
+        Coordinates getCoordinates() const { return Coordinates{x.data(), y.data(), z.data()}; }
+    };
+
+    // arrays of the mesh built in memory, they stay empty while the mesh is mapped from the cache
+    BuiltCoordinates builtVertices, builtEdges1, builtEdges2;
+    std::unique_ptr<MappedFile> cacheFile;
+
+    // point to the built arrays or into the mapped cache file
+    Coordinates vertices; // first vertex of every triangle
+    Coordinates edges1;   // B - A
+    Coordinates edges2;   // C - A
+    size_t trianglesCount;
+
+    // copies a mapped mesh into the built arrays, so that triangles can be added to it
+    void copyFromCache();
+
+    friend class KDTreeCache;
+
+public:
+    TriangleMesh(const Material &material) :
+            Primitive(material), vertices{nullptr, nullptr, nullptr}, edges1(vertices), edges2(vertices),
+            trianglesCount(0) { }
+
+    // the coordinates point to the arrays of the mesh
+    TriangleMesh(const TriangleMesh &) = delete;
+
+    TriangleMesh &operator=(const TriangleMesh &) = delete;
+
+    void reserve(size_t trianglesCount);
+
+    void addTriangle(const Point &A, const Point &B, const Point &C);
+
+    // the vertices are reordered so that the front face looks along the normal
+    void addTriangle(const Point &A, const Point &B, const Point &C, const Vector &normal);
+
+    size_t getTrianglesCount() const { return trianglesCount; }
+
+    virtual bool intersectWithRay(Point rayStart, Vector rayDirection, Intersection &intersection) const;
 
     BoundingBox getBoundingBox() const;
+
+    size_t getElementsCount() const { return getTrianglesCount(); }
+
+    BoundingBox getElementBoundingBox(size_t element) const;
+
+    // Moller-Trumbore. The barycentric coordinates may go out of the triangle by eps and t is compared
+    // with eps like Point::doubleGreater(t, 0), so a ray through an edge shared by two triangles
+    // hits at least one of them, as it does with Triangle.
+    bool findElementHit(size_t element, const Point &rayStart, const Vector &rayDirection, Hit &hit) const {
+        Vector edge1 = edges1[element];
+        Vector edge2 = edges2[element];
+
+        Vector p = rayDirection * edge2;
+        Real inverseDet = 1 / (edge1 % p);
+
+        // a ray parallel to the triangle gives det == 0 and NaN or infinite coordinates, which fail the checks below
+        Vector s = rayStart - vertices[element];
+        Real u = (s % p) * inverseDet;
+        Vector q = s * edge1;
+        Real v = (rayDirection % q) * inverseDet;
+        Real t = (edge2 % q) * inverseDet;
+
+        if (!(Point::doubleGreaterOrEqual(u, 0) && Point::doubleGreaterOrEqual(v, 0) &&
+              Point::doubleLessOrEqual(u + v, 1) && Point::doubleGreater(t, 0))) {
+            return false;
+        }
+        hit.t = t;
+        hit.u = u;
+        hit.v = v;
+        return true;
+    }
+
+    void getElementIntersection(size_t element, const Point &rayStart, const Vector &rayDirection, const Hit &hit,
+                                Intersection &intersection) const;
+
+#ifdef RAYTRACING_PACKETS
+    // Moller-Trumbore for the active lanes of a packet, the same computations as the single ray version.
+    // Returns the lanes where the triangle is hit closer than nearestT and updates nearestT.
+    PACKET_INLINE PacketInt intersectElementWithPacket(size_t element, const RayPacket &packet,
+                                                       const PacketInt &active, PacketReal &nearestT) const {
+        PacketVector edge1(edges1[element]);
+        PacketVector edge2(edges2[element]);
+
+        PacketVector p = packet.direction * edge2;
+        PacketReal det = edge1 % p;
+        PacketReal inverseDet = 1 / det;
+
+        PacketVector s = packet.start - PacketVector(vertices[element]);
+        PacketReal u = (s % p) * inverseDet;
+        PacketVector q = s * edge1;
+        PacketReal v = (packet.direction % q) * inverseDet;
+        PacketReal t = (edge2 % q) * inverseDet;
+
+        // the same tolerances as Point::doubleGreaterOrEqual, doubleLessOrEqual and doubleGreater
+        PacketInt hit = active & (u > -Point::eps) & (v > -Point::eps) & (u + v - 1 < Point::eps) &
+                        (t >= Point::eps) & (t < nearestT);
+        nearestT = hit ? t : nearestT;
+        return hit;
+    }
+#endif
 };
 
+// Convex polygon. Its plane and edges are prepared when it's created, so the test is the intersection
+// with the plane and one dot product per edge.
 class Polygon : public Primitive {
+    // point % normal >= offset inside the edge, the normal is scaled so that the tolerance applies to
+    // ((P[i + 1] - P[i]) * (X - P[i])) % ((P[i + 1] - P[i]) * (P[i + 2] - P[i])) like in the triangle test
+    struct Edge {
+        Vector normal;
+        Real offset;
+    };
+
     std::vector<Point> points;
+    Vector normal;         // (B - A) * (C - A) for the first three points
+    UnitVector unitNormal;
+    Real planeOffset;      // A % normal
+    std::vector<Edge> edges;
+
+    void prepare();
 
 public:
     Polygon(const std::vector<Point> points, const Material &material) :
-            points(points), Primitive(material) { }
+            points(points), Primitive(material) {
+        prepare();
+    }
 
     Polygon(const std::vector<Point> points, const Vector &normal, const Material &material);
 
-    virtual bool intersectWithRay(Point rayStart, Vector rayDirection, Intersection &intersection);
+    virtual bool intersectWithRay(Point rayStart, Vector rayDirection, Intersection &intersection) const {
+        return intersectByHit(rayStart, rayDirection, intersection);
+    }
+
+    bool findHit(const Point &rayStart, const Vector &rayDirection, Hit &hit) const;
+
+    void getIntersection(const Point &rayStart, const Vector &rayDirection, const Hit &hit,
+                         Intersection &intersection) const;
 
     BoundingBox getBoundingBox() const;
 };
 
 class Sphere : public Primitive {
     Point center;
-    double radius;
+    Real radius;
 
 public:
-    Sphere(const Point &center, double radius, const Material &material) :
+    Sphere(const Point &center, Real radius, const Material &material) :
             center(center), radius(radius), Primitive(material) { }
 
-    virtual bool intersectWithRay(Point rayStart, Vector rayDirection, Intersection &intersection);
+    virtual bool intersectWithRay(Point rayStart, Vector rayDirection, Intersection &intersection) const {
+        return intersectByHit(rayStart, rayDirection, intersection);
+    }
+
+    // The nearer root farther than eps from the start or the farther one from the inside, the distances
+    // are compared squared to skip the length of the direction
+    bool findHit(const Point &rayStart, const Vector &rayDirection, Hit &hit) const {
+        Vector fromCenter = rayStart - center;
+        Real a = rayDirection % rayDirection;
+        Real b = fromCenter % rayDirection;
+        Real discriminant = b * b - a * (fromCenter % fromCenter - radius * radius);
+        if (discriminant < 0) {
+            return false;
+        }
+
+        Real root = std::sqrt(discriminant);
+        Real minSquaredT = Point::eps * Point::eps / a;
+        hit.t = (-b - root) / a;
+        if (hit.t < 0 || hit.t * hit.t < minSquaredT) {
+            hit.t = (-b + root) / a;
+            if (hit.t < 0 || hit.t * hit.t < minSquaredT) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void getIntersection(const Point &rayStart, const Vector &rayDirection, const Hit &hit,
+                         Intersection &intersection) const;
 
     BoundingBox getBoundingBox() const;
 };
@@ -108,16 +360,16 @@ public:
 
 class LightSource {
     Point position;
-    double intensity;
+    Real intensity;
 
 public:
     LightSource() : intensity(0) { }
 
-    LightSource(const Point &position, double intensity) : position(position), intensity(intensity) { }
+    LightSource(const Point &position, Real intensity) : position(position), intensity(intensity) { }
 
     Point getPosition() const { return position; }
 
-    double getIntensity() const { return intensity; }
+    Real getIntensity() const { return intensity; }
 };
 
 
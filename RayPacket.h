@@ -0,0 +1,128 @@
+#ifndef RAYTRACING_RAYPACKET_H
+#define RAYTRACING_RAYPACKET_H
+
+#include <cstdint>
+#include <type_traits>
+
+#include "Vector.h"
+
+// Packets are written with GCC vector extensions, other compilers trace every ray on its own.
+// On x86-64 Linux the packet functions are compiled both for AVX2 and for the baseline instruction set,
+// the dynamic loader picks the version the processor supports.
+#if defined(__GNUC__)
+#define RAYTRACING_PACKETS
+#endif
+
+#ifdef RAYTRACING_PACKETS
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(__clang__)
+#define PACKET_TARGET_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define PACKET_TARGET_CLONES
+#endif
+
+// Vectors are passed differently with and without AVX, so functions taking or returning them by value
+// must be inlined into the cloned functions instead of being called from them
+#define PACKET_INLINE inline __attribute__((always_inline))
+
+// lanes in a 256-bit register
+const int packetSize = 32 / sizeof(Real);
+
+// integers of the Real size, used for lane masks (0 or -1) and indices
+typedef std::conditional<sizeof(Real) == sizeof(int32_t), int32_t, int64_t>::type PacketIntLane;
+
+typedef Real PacketReal __attribute__((vector_size(packetSize * sizeof(Real))));
+typedef PacketIntLane PacketInt __attribute__((vector_size(packetSize * sizeof(PacketIntLane))));
+
+PACKET_INLINE bool anyLane(const PacketInt &mask) {
+    for (int lane = 0; lane < packetSize; ++lane) {
+        if (mask[lane]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+PACKET_INLINE bool allLanes(const PacketInt &mask) {
+    for (int lane = 0; lane < packetSize; ++lane) {
+        if (!mask[lane]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// packetSize vectors, the operations repeat the ones of Vector lane by lane
+struct PacketVector {
+    PacketReal x, y, z;
+
+    PacketVector() = default;
+
+    PACKET_INLINE explicit PacketVector(const Vector &v) {
+        x = PacketReal{} + v.getX();
+        y = PacketReal{} + v.getY();
+        z = PacketReal{} + v.getZ();
+    }
+
+    PACKET_INLINE PacketVector(const PacketReal &x, const PacketReal &y, const PacketReal &z) :
+            x(x), y(y), z(z) { }
+
+    PACKET_INLINE const PacketReal &getCoordinate(int axis) const {
+        return axis == 0 ? x : (axis == 1 ? y : z);
+    }
+
+    Vector getLane(int lane) const { return Vector(x[lane], y[lane], z[lane]); }
+
+    void setLane(int lane, const Vector &v) {
+        x[lane] = v.getX();
+        y[lane] = v.getY();
+        z[lane] = v.getZ();
+    }
+
+    PACKET_INLINE PacketVector operator-(const PacketVector &v) const {
+        return PacketVector(x - v.x, y - v.y, z - v.z);
+    }
+
+    PACKET_INLINE friend PacketVector operator*(const PacketVector &a, const PacketVector &b) {
+        return PacketVector(a.y * b.z - a.z * b.y,
+                            a.z * b.x - a.x * b.z,
+                            a.x * b.y - a.y * b.x);
+    }
+
+    PACKET_INLINE friend PacketReal operator%(const PacketVector &a, const PacketVector &b) {
+        return a.x * b.x + a.y * b.y + a.z * b.z;
+    }
+};
+
+// Rays traced through the tree together. The common front-to-back order of the cells requires
+// all directions to lie in one octant, other packets are traced ray by ray.
+struct RayPacket {
+    RayPacket(const Point starts[], const Vector directions[]) : isCoherent(true) {
+        for (int lane = 0; lane < packetSize; ++lane) {
+            start.setLane(lane, starts[lane]);
+            direction.setLane(lane, directions[lane]);
+            inverseDirection.setLane(lane, Vector(1 / directions[lane].getX(), 1 / directions[lane].getY(),
+                                                  1 / directions[lane].getZ()));
+        }
+
+        for (int axis = 0; axis < 3; ++axis) {
+            sign[axis] = directions[0].getCoordinate(axis) < 0;
+            for (int lane = 0; lane < packetSize; ++lane) {
+                Real coordinate = directions[lane].getCoordinate(axis);
+                if (coordinate == 0 || (coordinate < 0) != sign[axis]) {
+                    isCoherent = false;
+                }
+            }
+        }
+    }
+
+    PacketVector start;
+    PacketVector direction;
+    PacketVector inverseDirection;
+    int sign[3];
+    bool isCoherent;
+};
+
+#endif
+
+#endif //RAYTRACING_RAYPACKET_H
@@ -0,0 +1,11 @@
+#ifndef RAYTRACING_REAL_H
+#define RAYTRACING_REAL_H
+
+// Floating point type of the geometry and the colors, float is chosen by the RAYTRACING_SINGLE_PRECISION option
+#ifdef RAYTRACING_SINGLE_PRECISION
+typedef float Real;
+#else
+typedef double Real;
+#endif
+
+#endif //RAYTRACING_REAL_H
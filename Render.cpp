@@ -1,47 +1,293 @@
+#include <algorithm>
+#include <cmath>
+
 #include "Render.h"
 
-Render::Render(Scene *scene, Screen screen, int height, int width) : scene(scene),
-                                                                     screen(screen), height(height),
-                                                                     width(width) {
-    calculatePixels();
+const Color Render::backgroundColor(0.05, 0.05, 0.05);
+
+Screen Screen::rotate(const Point &center, const Vector &axis, Real angle) const {
+    // Rodrigues' rotation formula
+    Vector k = axis.normalise();
+    Real cos = std::cos(angle), sin = std::sin(angle);
+    auto rotateVector = [&k, cos, sin](const Vector &v) {
+        return v * cos + (k * v) * sin + k * ((k % v) * (1 - cos));
+    };
+    return Screen(center + rotateVector(camera - center), center + rotateVector(leftBottomCorner - center),
+                  rotateVector(leftToRight), rotateVector(bottomToTop));
+}
+
+Render::Render(const Scene *scene, Screen screen, int height, int width, const RenderSettings &settings) :
+        Render(scene, screen, height, width, settings, PassHandler()) { }
+
+Render::Render(const Scene *scene, Screen screen, int height, int width, const RenderSettings &settings,
+               const PassHandler &handlePass) :
+        scene(scene), screen(screen), height(height), width(width), settings(settings), cancelled(false),
+        sampleGridSize(1), supersampledPixelsCount(0) {
+    calculatePixels(handlePass);
+}
+
+bool Render::isCancelRequested() const {
+    return settings.cancelFlag != nullptr && settings.cancelFlag->load(std::memory_order_relaxed);
+}
+
+void Render::calculatePixels(const PassHandler &handlePass) {
+    pixels.assign(static_cast<size_t>(height) * width, Pixel(Color(0, 0, 0)));
+
+    while ((sampleGridSize + 1) * (sampleGridSize + 1) <= settings.maxSamples) {
+        ++sampleGridSize;
+    }
+    if (sampleGridSize > 1) {
+        pixelSurfaces.assign(static_cast<size_t>(height) * width, Surface{nullptr, 0});
+    }
+
+    int firstStep = 1;
+    while (firstStep * 2 <= settings.previewStep) {
+        firstStep *= 2;
+    }
+
+    ThreadPool pool(settings.threadsCount);
+    for (int step = firstStep; step >= 1; step /= 2) {
+        bool isFirstPass = step == firstStep;
+        bool isDone;
+        {
+            PhaseTimer timer(Statistics::Trace);
+            isDone = forEachTile(pool, [this, step, isFirstPass](int firstRow, int lastRow, int firstColumn,
+                                                                 int lastColumn) {
+                calculateTile(firstRow, lastRow, firstColumn, lastColumn, step, isFirstPass);
+            });
+            // the edges are found in the full image
+            if (isDone && step == 1 && sampleGridSize > 1) {
+                isDone = antialias(pool);
+            }
+        }
+
+        if (!isDone) {
+            cancelled = true;
+            return;
+        }
+        if (handlePass && !handlePass(*this, step)) {
+            cancelled = step > 1;
+            return;
+        }
+    }
 }
 
-void Render::calculatePixels() {
-    colorMap = std::vector<std::vector<Color>>(height, std::vector<Color>(width));
+bool Render::forEachTile(ThreadPool &pool,
+                         const std::function<void(int firstRow, int lastRow, int firstColumn,
+                                                  int lastColumn)> &calculate) {
+    std::atomic<bool> tilesSkipped(false);
+    TaskGroup tiles;
 
-    for (int i = 0; i < height; ++i) {
-        for (int j = 0; j < width; ++j) {
-            Point screenPoint = screen.leftBottomCorner +
-                                screen.bottomToTop * (i * 1.0 / height) +
-                                screen.leftToRight * (j * 1.0 / width);
-            Vector rayDirection = screenPoint - screen.camera;
-            colorMap[height - 1 - i][j] = traceRay(screen.camera, rayDirection, 1, 0);
+    // tiles are spread over the threads queues, idle threads steal the rest
+    for (int firstRow = 0; firstRow < height; firstRow += settings.tileSize) {
+        for (int firstColumn = 0; firstColumn < width; firstColumn += settings.tileSize) {
+            int lastRow = std::min(firstRow + settings.tileSize, height);
+            int lastColumn = std::min(firstColumn + settings.tileSize, width);
+            pool.run(tiles, [this, &calculate, firstRow, lastRow, firstColumn, lastColumn, &tilesSkipped] {
+                if (isCancelRequested()) {
+                    tilesSkipped = true;
+                    return;
+                }
+                calculate(firstRow, lastRow, firstColumn, lastColumn);
+            });
         }
     }
+    pool.wait(tiles);
+    return !tilesSkipped;
+}
+
+Vector Render::getPrimaryRayDirection(Real row, Real column) const {
+    Point screenPoint = screen.leftBottomCorner +
+                        screen.bottomToTop * (row * 1.0 / height) +
+                        screen.leftToRight * (column * 1.0 / width);
+    return screenPoint - screen.camera;
 }
 
-bool Render::isVisible(Point rayStart, Vector rayDirection, Primitive *object) const {
+Color Render::tracePrimaryRay(Real row, Real column, Surface &surface) const {
+    Statistics::count(Statistics::PrimaryRays);
+    Vector direction = getPrimaryRayDirection(row, column);
     Intersection intersection;
 
-    if (scene->findRayIntersection(rayStart, rayDirection, intersection)) {
-        return intersection.primitive == object &&
-               Point::doubleEqual(0, (intersection.point - (rayStart + rayDirection)).length());
+    if (scene->findRayIntersection(screen.camera, direction, intersection)) {
+        surface = Surface{intersection.primitive, intersection.element};
+        return shadeIntersection(direction, intersection, 1, 0);
+    }
+    else {
+        surface = Surface{nullptr, 0};
+        return backgroundColor;
+    }
+}
+
+void Render::setPixel(int row, int column, const Color &color, const Surface &surface) {
+    size_t pixel = getPixelIndex(height - 1 - row, column);
+    pixels[pixel] = Pixel(color);
+    if (!pixelSurfaces.empty()) {
+        pixelSurfaces[pixel] = surface;
+    }
+}
+
+// Traces the pixels on the grid of the step which weren't traced by the coarser passes. Every traced pixel
+// fills the step x step block starting at it, the finer passes overwrite the rest of the block.
+void Render::calculateTile(int firstRow, int lastRow, int firstColumn, int lastColumn, int step, bool isFirstPass) {
+#ifdef RAYTRACING_PACKETS
+    // the packet blocks are whole only when all pixels are traced in one pass
+    if (settings.usePackets && step == 1 && isFirstPass) {
+        calculateTilePackets(firstRow, lastRow, firstColumn, lastColumn);
+        return;
+    }
+#endif
+
+    int coarseStep = step * 2;
+    for (int i = (firstRow + step - 1) / step * step; i < lastRow; i += step) {
+        for (int j = (firstColumn + step - 1) / step * step; j < lastColumn; j += step) {
+            if (!isFirstPass && i % coarseStep == 0 && j % coarseStep == 0) {
+                continue;
+            }
+
+            Surface surface;
+            Color color = tracePrimaryRay(i, j, surface);
+            for (int row = i; row < std::min(i + step, height); ++row) {
+                for (int column = j; column < std::min(j + step, width); ++column) {
+                    setPixel(row, column, color, surface);
+                }
+            }
+        }
     }
-    return false;
 }
 
-double Render::countRayIntensity(const Intersection &intersection) const {
-    double rayIntensity = 0;
+#ifdef RAYTRACING_PACKETS
 
-    for (auto lightSource : scene->getLightSources()) {
-        if (isVisible(lightSource.getPosition(), intersection.point - lightSource.getPosition(),
-                      intersection.primitive)) {
-            double incidence = intersection.surfaceNormal.normalise() %
-                               (lightSource.getPosition() - intersection.point).normalise();
+// Primary rays of 2 x (packetSize / 2) pixel blocks are traced together, the secondary rays one by one.
+// Pixels at the tile border which don't fill a block are traced alone.
+void Render::calculateTilePackets(int firstRow, int lastRow, int firstColumn, int lastColumn) {
+    const int blockHeight = 2, blockWidth = packetSize / blockHeight;
 
-            if (incidence > 0) {
-                rayIntensity += lightSource.getIntensity() * incidence /
-                                (lightSource.getPosition() - intersection.point).squaredLength();
+    for (int i = firstRow; i < lastRow; i += blockHeight) {
+        for (int j = firstColumn; j < lastColumn; j += blockWidth) {
+            if (i + blockHeight > lastRow || j + blockWidth > lastColumn) {
+                for (int row = i; row < std::min(i + blockHeight, lastRow); ++row) {
+                    for (int column = j; column < std::min(j + blockWidth, lastColumn); ++column) {
+                        Surface surface;
+                        Color color = tracePrimaryRay(row, column, surface);
+                        setPixel(row, column, color, surface);
+                    }
+                }
+                continue;
+            }
+
+            Point starts[packetSize];
+            Vector directions[packetSize];
+            for (int lane = 0; lane < packetSize; ++lane) {
+                starts[lane] = screen.camera;
+                directions[lane] = getPrimaryRayDirection(i + lane / blockWidth, j + lane % blockWidth);
+            }
+
+            Statistics::count(Statistics::PrimaryRays, packetSize);
+            Intersection intersections[packetSize];
+            bool found[packetSize];
+            scene->findPacketIntersection(RayPacket(starts, directions), intersections, found);
+
+            for (int lane = 0; lane < packetSize; ++lane) {
+                int row = i + lane / blockWidth, column = j + lane % blockWidth;
+                if (found[lane]) {
+                    setPixel(row, column, shadeIntersection(directions[lane], intersections[lane], 1, 0),
+                             Surface{intersections[lane].primitive, intersections[lane].element});
+                }
+                else {
+                    setPixel(row, column, backgroundColor, Surface{nullptr, 0});
+                }
+            }
+        }
+    }
+}
+
+#endif
+
+// A pixel is at an edge if it sees another surface than its right or upper neighbour or differs from it
+// too much, both pixels of such a pair are marked
+std::vector<uint8_t> Render::findEdgePixels() const {
+    std::vector<uint8_t> isEdge(static_cast<size_t>(height) * width, 0);
+    auto compare = [this, &isEdge](size_t pixel, size_t neighbour) {
+        if (pixelSurfaces[pixel] != pixelSurfaces[neighbour] ||
+            pixels[pixel].getColor().getDifference(pixels[neighbour].getColor()) > settings.edgeContrast) {
+            isEdge[pixel] = 1;
+            isEdge[neighbour] = 1;
+        }
+    };
+
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            size_t pixel = getPixelIndex(y, x);
+            if (x + 1 < width) {
+                compare(pixel, pixel + 1);
+            }
+            if (y + 1 < height) {
+                compare(pixel, pixel + width);
+            }
+        }
+    }
+    return isEdge;
+}
+
+// the pixel ray goes through the first point of the grid, so it's reused as a sample
+void Render::supersamplePixel(int row, int column) {
+    size_t pixel = getPixelIndex(height - 1 - row, column);
+    Color sum = pixels[pixel].getColor();
+    for (int i = 0; i < sampleGridSize; ++i) {
+        for (int j = 0; j < sampleGridSize; ++j) {
+            if (i == 0 && j == 0) {
+                continue;
+            }
+            Surface surface;
+            sum = sum + tracePrimaryRay(row + i * 1.0 / sampleGridSize, column + j * 1.0 / sampleGridSize,
+                                        surface);
+        }
+    }
+    pixels[pixel] = Pixel(sum * (1.0 / (sampleGridSize * sampleGridSize)));
+}
+
+bool Render::antialias(ThreadPool &pool) {
+    std::vector<uint8_t> isEdge = findEdgePixels();
+    std::atomic<int> supersampledCount(0);
+
+    bool isDone = forEachTile(pool, [this, &isEdge, &supersampledCount](int firstRow, int lastRow, int firstColumn,
+                                                                         int lastColumn) {
+        int tileCount = 0;
+        for (int row = firstRow; row < lastRow; ++row) {
+            for (int column = firstColumn; column < lastColumn; ++column) {
+                if (isEdge[getPixelIndex(height - 1 - row, column)]) {
+                    supersamplePixel(row, column);
+                    ++tileCount;
+                }
+            }
+        }
+        supersampledCount += tileCount;
+    });
+
+    supersampledPixelsCount = supersampledCount;
+    return isDone;
+}
+
+// the shadow ray goes from the light, so the shaded surface itself is hit only at the end of the segment
+bool Render::isVisible(const Point &lightPosition, const Vector &toPoint, Real distance) const {
+    Statistics::count(Statistics::ShadowRays);
+    return !scene->isOccluded(lightPosition, toPoint, distance);
+}
+
+// Lights behind the surface add nothing, so their shadow rays aren't traced. The cosine of the incidence
+// is the dot product with the normal divided by the distance, which is found once for both uses.
+Real Render::countRayIntensity(const Intersection &intersection) const {
+    Real rayIntensity = 0;
+
+    for (const LightSource &lightSource : scene->getLightSources()) {
+        Vector toLight = lightSource.getPosition() - intersection.point;
+        Real scaledIncidence = intersection.surfaceNormal % toLight;
+
+        if (scaledIncidence > 0) {
+            Real squaredDistance = toLight.squaredLength();
+            Real distance = std::sqrt(squaredDistance);
+            if (isVisible(lightSource.getPosition(), toLight * -1, distance)) {
+                rayIntensity += lightSource.getIntensity() * scaledIncidence / (distance * squaredDistance);
             }
         }
     }
@@ -49,45 +295,54 @@ double Render::countRayIntensity(const Intersection &intersection) const {
     return rayIntensity;
 }
 
-Color Render::traceRay(Point &rayStart, Vector rayDirection, double intensity, int depth) const {
+Color Render::traceRay(const Point &rayStart, Vector rayDirection, Real intensity, int depth,
+                       Statistics::Counter rayKind) const {
     if (depth > maxDepth || intensity < minIntensity) {
         return Color(0, 0, 0);
     }
+    Statistics::count(rayKind);
+    Statistics::updateMaxRayDepth(depth);
     Intersection intersection;
 
     if (scene->findRayIntersection(rayStart, rayDirection, intersection)) {
-        Color reflectedColor(0, 0, 0);
-        if (intersection.isFrontFace && intersection.primitive->getMaterial().getReflect() > 1e-3) {
-            Vector reflectedRayDirection = rayDirection.reflect(intersection.surfaceNormal);
-            reflectedColor = traceRay(intersection.point, reflectedRayDirection,
-                                      intensity * intersection.primitive->getMaterial().getReflect(), depth + 1);
-        }
+        return shadeIntersection(rayDirection, intersection, intensity, depth);
+    }
+    else {
+        return backgroundColor;
+    }
+}
 
-        if (Point::doubleEqual(intersection.primitive->getMaterial().getRefract(), 0)) {
-            double rayIntensity = countRayIntensity(intersection);
-            return intersection.color * rayIntensity * (1 - intersection.primitive->getMaterial().getReflect()) +
-                   reflectedColor * intersection.primitive->getMaterial().getReflect();
-        }
-        else {
-            Vector refractedRayDirection;
-            if (intersection.isFrontFace) {
-                refractedRayDirection = rayDirection.refract(intersection.surfaceNormal,
-                                                             intersection.primitive->getMaterial().getRefract());
-            }
-            else {
-                refractedRayDirection = rayDirection.refract(intersection.surfaceNormal,
-                                                             1 / intersection.primitive->getMaterial().getRefract());
-            }
+Color Render::shadeIntersection(const Vector &rayDirection, const Intersection &intersection, Real intensity,
+                                int depth) const {
+    Color reflectedColor(0, 0, 0);
+    if (intersection.isFrontFace && intersection.primitive->getMaterial().getReflect() > 1e-3) {
+        Vector reflectedRayDirection = rayDirection.reflect(intersection.surfaceNormal);
+        reflectedColor = traceRay(intersection.point, reflectedRayDirection,
+                                  intensity * intersection.primitive->getMaterial().getReflect(), depth + 1,
+                                  Statistics::ReflectionRays);
+    }
 
-            Color refractedColor = traceRay(intersection.point, refractedRayDirection,
-                                            intensity * (1 - intersection.primitive->getMaterial().getReflect()),
-                                            depth + 1);
-            return refractedColor * (1 - intersection.primitive->getMaterial().getReflect()) +
-                   reflectedColor * intersection.primitive->getMaterial().getReflect();
-        }
+    if (Point::doubleEqual(intersection.primitive->getMaterial().getRefract(), 0)) {
+        Real rayIntensity = countRayIntensity(intersection);
+        return intersection.color * rayIntensity * (1 - intersection.primitive->getMaterial().getReflect()) +
+               reflectedColor * intersection.primitive->getMaterial().getReflect();
     }
     else {
-        return Color(0.05, 0.05, 0.05);
+        Vector refractedRayDirection;
+        if (intersection.isFrontFace) {
+            refractedRayDirection = rayDirection.refract(intersection.surfaceNormal,
+                                                         intersection.primitive->getMaterial().getRefract());
+        }
+        else {
+            refractedRayDirection = rayDirection.refract(intersection.surfaceNormal,
+                                                         1 / intersection.primitive->getMaterial().getRefract());
+        }
+
+        Color refractedColor = traceRay(intersection.point, refractedRayDirection,
+                                        intensity * (1 - intersection.primitive->getMaterial().getReflect()),
+                                        depth + 1, Statistics::RefractionRays);
+        return refractedColor * (1 - intersection.primitive->getMaterial().getReflect()) +
+               reflectedColor * intersection.primitive->getMaterial().getReflect();
     }
 }
 
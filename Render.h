@@ -1,10 +1,15 @@
 #ifndef RAYTRACING_RENDER_H
 #define RAYTRACING_RENDER_H
 
+#include <atomic>
+#include <cstdint>
+#include <functional>
 #include <vector>
 
 #include "Material.h"
 #include "Scene.h"
+#include "Statistics.h"
+#include "ThreadPool.h"
 
 struct Screen {
     Screen() = default;
@@ -18,38 +23,154 @@ struct Screen {
                  (leftToRight * bottomToTop).normalise(1.5 * leftToRight.length());
     }
 
+    // the screen and the camera turned by the angle around the axis going through the center
+    Screen rotate(const Point &center, const Vector &axis, Real angle) const;
+
     Point camera;
     Point leftBottomCorner;
     Vector leftToRight;
     Vector bottomToTop;
 };
 
+struct RenderSettings {
+    RenderSettings() : threadsCount(0), tileSize(16), usePackets(true), previewStep(1), cancelFlag(nullptr),
+                       maxSamples(1), edgeContrast(0.1) { }
+
+    RenderSettings(int threadsCount, int tileSize = 16, bool usePackets = true) :
+            threadsCount(threadsCount), tileSize(tileSize), usePackets(usePackets), previewStep(1),
+            cancelFlag(nullptr), maxSamples(1), edgeContrast(0.1) { }
+
+    int threadsCount; // 0 means one thread per hardware core
+    int tileSize;
+    bool usePackets;  // trace primary rays in packets where the compiler supports them
+
+    // The first pass traces every previewStep-th pixel of every previewStep-th row, every next pass halves
+    // the step until all pixels are traced. Rounded down to a power of two, 1 renders in a single pass.
+    int previewStep;
+    // the tiles which aren't started when the flag is set are skipped, may be set from any thread
+    const std::atomic<bool> *cancelFlag;
+
+    // Adaptive anti-aliasing: pixels at edges are traced again on a grid of maxSamples rays, rounded down
+    // to a square, 1 turns it off. A pixel is at an edge if its neighbour sees another primitive or another
+    // triangle of a mesh, or differs by more than edgeContrast in a channel.
+    int maxSamples;
+    Real edgeContrast;
+};
+
+// Framebuffer pixel, kept in floats whatever Real is, which halves the image memory of the double build
+struct Pixel {
+    float r, g, b;
+
+    Pixel() = default;
+
+    explicit Pixel(const Color &color) :
+            r(static_cast<float>(color.getRed())), g(static_cast<float>(color.getGreen())),
+            b(static_cast<float>(color.getBlue())) { }
+
+    Color getColor() const { return Color(r, g, b); }
+};
+
 class Render {
-    std::vector<std::vector<Color>> colorMap;
-    Scene *scene;
+public:
+    // Called after every finished pass with the step of its pixel grid, the step 1 pass is the last one.
+    // Returns false to cancel the rendering.
+    typedef std::function<bool(const Render &render, int step)> PassHandler;
+
+private:
+    // image rows from the top, the render threads write the pixels in place
+    std::vector<Pixel> pixels;
+    const Scene *scene;
     Screen screen;
     int height;
     int width;
+    RenderSettings settings;
+    bool cancelled;
+    // What the primary ray of a pixel sees. The element tells the triangles of a mesh or an instance apart,
+    // so that their silhouettes on each other are found as edges too.
+    struct Surface {
+        const Primitive *primitive;
+        uint32_t element;
+
+        bool operator!=(const Surface &other) const {
+            return primitive != other.primitive || element != other.element;
+        }
+    };
+
+    // the surfaces seen by the primary rays of the pixels, kept only for the anti-aliasing
+    std::vector<Surface> pixelSurfaces;
+    int sampleGridSize;
+    int supersampledPixelsCount;
 
     const static int maxDepth = 15;
-    constexpr static double minIntensity = 0.1;
+    constexpr static Real minIntensity = 0.1;
+    const static Color backgroundColor;
+
+    void calculatePixels(const PassHandler &handlePass);
+
+    bool isCancelRequested() const;
+
+    // false if the rendering was cancelled before all tiles were done
+    bool forEachTile(ThreadPool &pool,
+                     const std::function<void(int firstRow, int lastRow, int firstColumn, int lastColumn)> &calculate);
+
+    void calculateTile(int firstRow, int lastRow, int firstColumn, int lastColumn, int step, bool isFirstPass);
+
+    size_t getPixelIndex(int y, int x) const { return static_cast<size_t>(y) * width + x; }
 
-    void calculatePixels();
+    void setPixel(int row, int column, const Color &color, const Surface &surface);
 
-    bool isVisible(Point rayStart, Vector rayDirection, Primitive *object) const;
+    bool antialias(ThreadPool &pool);
 
-    double countRayIntensity(const Intersection &intersection) const;
+    std::vector<uint8_t> findEdgePixels() const;
 
-    Color traceRay(Point &rayStart, Vector rayDirection, double intensity, int depth) const;
+    void supersamplePixel(int row, int column);
+
+#ifdef RAYTRACING_PACKETS
+    void calculateTilePackets(int firstRow, int lastRow, int firstColumn, int lastColumn);
+#endif
+
+    Vector getPrimaryRayDirection(Real row, Real column) const;
+
+    Color tracePrimaryRay(Real row, Real column, Surface &surface) const;
+
+    bool isVisible(const Point &lightPosition, const Vector &toPoint, Real distance) const;
+
+    Real countRayIntensity(const Intersection &intersection) const;
+
+    // the ray is counted as the rayKind if it's traced
+    Color traceRay(const Point &rayStart, Vector rayDirection, Real intensity, int depth,
+                   Statistics::Counter rayKind) const;
+
+    Color shadeIntersection(const Vector &rayDirection, const Intersection &intersection, Real intensity,
+                            int depth) const;
 
 public:
-    Render(Scene *scene, Screen screen, int height, int width);
+    Render(const Scene *scene, Screen screen, int height, int width,
+           const RenderSettings &settings = RenderSettings());
+
+    // progressive rendering, every pass refines the image of the previous ones
+    Render(const Scene *scene, Screen screen, int height, int width, const RenderSettings &settings,
+           const PassHandler &handlePass);
+
+    // true if the rendering was stopped before the last pass, the image has the coarser samples where it stopped
+    bool isCancelled() const { return cancelled; }
+
+    int getSupersampledPixelsCount() const { return supersampledPixelsCount; }
+
+    // traced primary rays per pixel
+    double getSamplesPerPixel() const {
+        return 1 + supersampledPixelsCount * (sampleGridSize * sampleGridSize - 1.0) /
+                   (static_cast<double>(height) * width);
+    }
+
+    int getHeight() const { return height; }
 
-    int getHeight() const { return colorMap.size(); }
+    int getWidth() const { return width; }
 
-    int getWidth() const { return colorMap[0].size(); }
+    Color getPixel(int y, int x) const { return pixels[getPixelIndex(y, x)].getColor(); }
 
-    Color getPixel(int y, int x) { return colorMap[y][x]; }
+    // the width pixels of the image row y, counted from the top
+    const Pixel *getRow(int y) const { return &pixels[getPixelIndex(y, 0)]; }
 };
 
 
@@ -1,24 +1,23 @@
 #include "Scene.h"
 
-Scene::~Scene() {
-    for (auto object: objects) {
-        delete object;
-    }
-}
-
-void Scene::addObject(Primitive *primitive) {
-    objects.push_back(primitive);
-}
-
 void Scene::addLightSource(const LightSource &lightSource) {
     lightSources.push_back(lightSource);
 }
 
-void Scene::buildScene() {
-    objectsTree.buildTree(objects);
+void Scene::buildScene(const KDTreeSettings &settings) {
+    for (InstancedMesh *mesh : instancedMeshes) {
+        mesh->buildTree(settings);
+    }
+    objectsTree.buildTree(objects, settings);
 }
 
-bool Scene::findRayIntersection(Point rayStart, Vector rayDirection, Intersection &nearestIntersection) {
+BoundingBox Scene::getBoundingBox() const {
+    BoundingBox box;
+    box.boundPrimitives(objects);
+    return box;
+}
+
+bool Scene::findRayIntersection(Point rayStart, Vector rayDirection, Intersection &nearestIntersection) const {
     return objectsTree.findRayIntersection(rayStart, rayDirection, nearestIntersection);
 }
 
@@ -29,5 +28,16 @@ bool Scene::findRayIntersection(Point rayStart, Vector rayDirection, Intersectio
 
 
 
+bool Scene::isOccluded(const Point &rayStart, const Vector &rayDirection, Real maxDistance) const {
+    return objectsTree.isOccluded(rayStart, rayDirection, maxDistance);
+}
+
+#ifdef RAYTRACING_PACKETS
+void Scene::findPacketIntersection(const RayPacket &packet, Intersection intersections[], bool found[]) const {
+    objectsTree.findPacketIntersection(packet, intersections, found);
+}
+#endif
+
+
 
 
@@ -2,22 +2,58 @@
 #define RAYTRACING_SCENE_H
 
 
+#include <initializer_list>
+#include <vector>
+
+#include "Arena.h"
 #include "Primitives.h"
 #include "KDTree.h"
+#include "MeshInstance.h"
 
 class Scene {
+    // storage of the objects, destroyed after the tree referring to them
+    Arena arena;
     std::vector<Primitive *> objects;
+    std::vector<InstancedMesh *> instancedMeshes;
     std::vector<LightSource> lightSources;
     KDTree objectsTree;
 
 public:
-    ~Scene();
-    void addObject(Primitive *primitive);
+    // Constructs an object in the scene arena, it lives as long as the scene
+    template<class T, class... Args>
+    T *createObject(Args &&... args) {
+        T *object = arena.create<T>(std::forward<Args>(args)...);
+        objects.push_back(object);
+        return object;
+    }
+
+    // lets the vertices of a polygon be written in braces
+    template<class T, class... Args>
+    T *createObject(std::initializer_list<Point> points, Args &&... args) {
+        return createObject<T>(std::vector<Point>(points), std::forward<Args>(args)...);
+    }
+
+    // Mesh for MeshInstance objects, its tree is built with the scene before the tree of the objects
+    InstancedMesh *createInstancedMesh(const Material &material) {
+        InstancedMesh *mesh = arena.create<InstancedMesh>(material);
+        instancedMeshes.push_back(mesh);
+        return mesh;
+    }
+
     void addLightSource(const LightSource &lightSource);
-    void buildScene();
-    bool findRayIntersection(Point rayStart, Vector rayDirection, Intersection &nearestIntersection);
+    void buildScene(const KDTreeSettings &settings = KDTreeSettings());
+    BoundingBox getBoundingBox() const;
+    bool findRayIntersection(Point rayStart, Vector rayDirection, Intersection &nearestIntersection) const;
+    bool isOccluded(const Point &rayStart, const Vector &rayDirection, Real maxDistance) const;
+#ifdef RAYTRACING_PACKETS
+    void findPacketIntersection(const RayPacket &packet, Intersection intersections[], bool found[]) const;
+#endif
 
     const std::vector<LightSource> &getLightSources() const { return lightSources; }
+
+    const KDTreeStats &getTreeStats() const { return objectsTree.getStats(); }
+
+    const ArenaStats &getAllocationStats() const { return arena.getStats(); }
 };
 
 
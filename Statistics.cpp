@@ -0,0 +1,144 @@
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#include "Statistics.h"
+
+namespace {
+    struct ThreadCounters {
+        // only the owning thread writes, the atomics let the snapshots read them while it counts
+        std::atomic<uint64_t> counters[Statistics::CountersCount];
+        std::atomic<int> maxRayDepth;
+
+        ThreadCounters() {
+            reset();
+        }
+
+        void reset() {
+            for (auto &counter : counters) {
+                counter.store(0, std::memory_order_relaxed);
+            }
+            maxRayDepth.store(0, std::memory_order_relaxed);
+        }
+    };
+
+    // Counters of the running threads and the sums of the finished ones, the render thread pools
+    // are short-lived, so the counts of their threads are kept when they exit
+    struct Registry {
+        Registry() : finishedMaxRayDepth(0) {
+            std::fill(finishedCounters, finishedCounters + Statistics::CountersCount, 0);
+            for (auto &nanoseconds : phaseNanoseconds) {
+                nanoseconds.store(0);
+            }
+        }
+
+        std::mutex mutex;
+        std::vector<ThreadCounters *> threads;
+        uint64_t finishedCounters[Statistics::CountersCount];
+        int finishedMaxRayDepth;
+        std::atomic<uint64_t> phaseNanoseconds[Statistics::PhasesCount];
+    };
+
+    Registry &getRegistry() {
+        static Registry registry;
+        return registry;
+    }
+
+    struct ThreadSlot {
+        ThreadCounters counters;
+
+        ThreadSlot() {
+            Registry &registry = getRegistry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.threads.push_back(&counters);
+        }
+
+        ~ThreadSlot() {
+            Registry &registry = getRegistry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            for (int i = 0; i < Statistics::CountersCount; ++i) {
+                registry.finishedCounters[i] += counters.counters[i].load(std::memory_order_relaxed);
+            }
+            registry.finishedMaxRayDepth = std::max(registry.finishedMaxRayDepth,
+                                                    counters.maxRayDepth.load(std::memory_order_relaxed));
+            registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), &counters));
+        }
+    };
+
+    ThreadCounters &getThreadCounters() {
+        thread_local ThreadSlot slot;
+        return slot.counters;
+    }
+}
+
+std::atomic<bool> Statistics::enabled(false);
+
+void Statistics::addToThread(Counter counter, uint64_t value) {
+    std::atomic<uint64_t> &threadCounter = getThreadCounters().counters[counter];
+    threadCounter.store(threadCounter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+void Statistics::updateThreadMaxRayDepth(int depth) {
+    std::atomic<int> &maxRayDepth = getThreadCounters().maxRayDepth;
+    if (depth > maxRayDepth.load(std::memory_order_relaxed)) {
+        maxRayDepth.store(depth, std::memory_order_relaxed);
+    }
+}
+
+void Statistics::addTime(Phase phase, double seconds) {
+    getRegistry().phaseNanoseconds[phase].fetch_add(static_cast<uint64_t>(seconds * 1e9));
+}
+
+Statistics::Snapshot Statistics::getSnapshot() {
+    Registry &registry = getRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    Snapshot snapshot;
+    for (int i = 0; i < CountersCount; ++i) {
+        snapshot.counters[i] = registry.finishedCounters[i];
+        for (const ThreadCounters *thread : registry.threads) {
+            snapshot.counters[i] += thread->counters[i].load(std::memory_order_relaxed);
+        }
+    }
+    snapshot.maxRayDepth = registry.finishedMaxRayDepth;
+    for (const ThreadCounters *thread : registry.threads) {
+        snapshot.maxRayDepth = std::max(snapshot.maxRayDepth, thread->maxRayDepth.load(std::memory_order_relaxed));
+    }
+    for (int i = 0; i < PhasesCount; ++i) {
+        snapshot.seconds[i] = registry.phaseNanoseconds[i].load() / 1e9;
+    }
+    return snapshot;
+}
+
+void Statistics::reset() {
+    Registry &registry = getRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    std::fill(registry.finishedCounters, registry.finishedCounters + CountersCount, 0);
+    registry.finishedMaxRayDepth = 0;
+    for (ThreadCounters *thread : registry.threads) {
+        thread->reset();
+    }
+    for (auto &nanoseconds : registry.phaseNanoseconds) {
+        nanoseconds.store(0);
+    }
+}
+
+void Statistics::report(std::ostream &stream) {
+    Snapshot snapshot = getSnapshot();
+    const uint64_t *counters = snapshot.counters;
+
+    stream << "rays: " << counters[PrimaryRays] << " primary, " << counters[ReflectionRays] << " reflection, " <<
+    counters[RefractionRays] << " refraction, " << counters[ShadowRays] << " shadow";
+    if (counters[PrimaryRays] > 0) {
+        stream << ", " << snapshot.getRaysCount() * 1.0 / counters[PrimaryRays] << " per primary ray";
+    }
+    stream << "\n";
+    stream << "max ray depth: " << snapshot.maxRayDepth << "\n";
+    stream << "single rays: " << counters[NodeVisits] << " node visits, " << counters[PrimitiveTests] <<
+    " primitive tests\n";
+    stream << "packets: " << counters[PacketNodeVisits] << " node visits, " << counters[PacketPrimitiveTests] <<
+    " primitive tests\n";
+    stream << "time: parse " << snapshot.seconds[Parse] * 1000 << " ms, build " << snapshot.seconds[Build] * 1000 <<
+    " ms, trace " << snapshot.seconds[Trace] * 1000 << " ms, encode " << snapshot.seconds[Encode] * 1000 << " ms\n";
+}
@@ -0,0 +1,126 @@
+#ifndef RAYTRACING_STATISTICS_H
+#define RAYTRACING_STATISTICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+// Counters of the rendering work and the time of the phases. Every thread counts into its own slots,
+// which are only summed up for a snapshot, so counting takes no locks and shares no cache lines.
+// Counting is off until setEnabled(true), before that an event costs one predictable branch.
+class Statistics {
+public:
+    enum Counter {
+        PrimaryRays,
+        ReflectionRays,
+        RefractionRays,
+        ShadowRays,
+        NodeVisits,           // tree nodes visited by single rays
+        PrimitiveTests,       // ray-primitive tests of single rays
+        PacketNodeVisits,     // tree nodes visited by ray packets, once per packet
+        PacketPrimitiveTests, // packet-primitive tests, once per packet
+        CountersCount
+    };
+
+    enum Phase {
+        Parse, Build, Trace, Encode, PhasesCount
+    };
+
+    struct Snapshot {
+        uint64_t counters[CountersCount];
+        int maxRayDepth;
+        double seconds[PhasesCount];
+
+        uint64_t getRaysCount() const {
+            return counters[PrimaryRays] + counters[ReflectionRays] + counters[RefractionRays] + counters[ShadowRays];
+        }
+    };
+
+private:
+    static std::atomic<bool> enabled;
+
+    static void addToThread(Counter counter, uint64_t value);
+
+    static void updateThreadMaxRayDepth(int depth);
+
+public:
+    static bool isEnabled() { return enabled.load(std::memory_order_relaxed); }
+
+    static void setEnabled(bool isEnabled) { enabled.store(isEnabled); }
+
+    static void count(Counter counter, uint64_t value = 1) {
+        if (isEnabled()) {
+            addToThread(counter, value);
+        }
+    }
+
+    static void updateMaxRayDepth(int depth) {
+        if (isEnabled()) {
+            updateThreadMaxRayDepth(depth);
+        }
+    }
+
+    static void addTime(Phase phase, double seconds);
+
+    // the counters of threads which are still counting may be missing a few latest events
+    static Snapshot getSnapshot();
+
+    static void reset();
+
+    static void report(std::ostream &stream);
+};
+
+// Counts events of a hot loop in a register and adds them to the statistics at the end of the scope
+class LocalCounter {
+    Statistics::Counter counter;
+    uint64_t value;
+
+public:
+    explicit LocalCounter(Statistics::Counter counter) : counter(counter), value(0) { }
+
+    ~LocalCounter() {
+        if (value != 0) {
+            Statistics::count(counter, value);
+        }
+    }
+
+    LocalCounter(const LocalCounter &) = delete;
+
+    LocalCounter &operator=(const LocalCounter &) = delete;
+
+    void operator++() { ++value; }
+
+    void operator+=(uint64_t events) { value += events; }
+};
+
+// Adds the time of its scope to the phase. Only the outermost timer of a phase on a thread counts,
+// so the STL loader called by the scene loader doesn't add the parsing time twice.
+class PhaseTimer {
+    Statistics::Phase phase;
+    bool isOutermost;
+    std::chrono::steady_clock::time_point start;
+
+    static int &getDepth(Statistics::Phase phase) {
+        static thread_local int depths[Statistics::PhasesCount] = {};
+        return depths[phase];
+    }
+
+public:
+    explicit PhaseTimer(Statistics::Phase phase) :
+            phase(phase), isOutermost(getDepth(phase)++ == 0), start(std::chrono::steady_clock::now()) { }
+
+    ~PhaseTimer() {
+        --getDepth(phase);
+        if (isOutermost && Statistics::isEnabled()) {
+            Statistics::addTime(phase, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+    }
+
+    PhaseTimer(const PhaseTimer &) = delete;
+
+    PhaseTimer &operator=(const PhaseTimer &) = delete;
+};
+
+
+#endif //RAYTRACING_STATISTICS_H
@@ -0,0 +1,139 @@
+#include "ThreadPool.h"
+
+namespace {
+    thread_local const ThreadPool *currentPool = nullptr;
+    thread_local int currentPoolQueue = -1;
+}
+
+ThreadPool::ThreadPool(int threadsCount) : threadsCount(threadsCount > 0 ? threadsCount : getHardwareThreadsCount()),
+                                           queuedTasks(0), nextQueue(0), stopping(false) {
+    for (int i = 0; i < this->threadsCount; ++i) {
+        queues.emplace_back(new WorkQueue());
+    }
+    // the last queue belongs to the threads calling wait()
+    for (int i = 0; i < this->threadsCount - 1; ++i) {
+        workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    wakeUp.notify_all();
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+}
+
+int ThreadPool::getHardwareThreadsCount() {
+    unsigned count = std::thread::hardware_concurrency();
+    return count > 0 ? static_cast<int>(count) : 1;
+}
+
+int ThreadPool::getCurrentQueue() const {
+    return currentPool == this ? currentPoolQueue : threadsCount - 1;
+}
+
+void ThreadPool::run(TaskGroup &group, Task task) {
+    ++group.pendingTasks;
+
+    // tasks spawned by a worker stay local, external tasks are spread over all queues
+    int queue = currentPool == this ? currentPoolQueue : static_cast<int>(nextQueue++ % threadsCount);
+    {
+        std::lock_guard<std::mutex> lock(queues[queue]->mutex);
+        queues[queue]->tasks.emplace_back(std::move(task), &group);
+    }
+    ++queuedTasks;
+
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+    }
+    wakeUp.notify_one();
+}
+
+void ThreadPool::wait(TaskGroup &group) {
+    int queue = getCurrentQueue();
+    while (!group.isFinished()) {
+        if (!executeTask(queue)) {
+            std::this_thread::yield();
+        }
+    }
+
+    std::exception_ptr error;
+    {
+        std::lock_guard<std::mutex> lock(group.errorMutex);
+        std::swap(error, group.error);
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+bool ThreadPool::popTask(int queue, std::pair<Task, TaskGroup *> &task) {
+    std::lock_guard<std::mutex> lock(queues[queue]->mutex);
+    if (queues[queue]->tasks.empty()) {
+        return false;
+    }
+    task = std::move(queues[queue]->tasks.back());
+    queues[queue]->tasks.pop_back();
+    return true;
+}
+
+bool ThreadPool::stealTask(int queue, std::pair<Task, TaskGroup *> &task) {
+    for (int i = 1; i < threadsCount; ++i) {
+        WorkQueue &victim = *queues[(queue + i) % threadsCount];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ThreadPool::executeTask(int queue) {
+    std::pair<Task, TaskGroup *> task;
+    if (!popTask(queue, task) && !stealTask(queue, task)) {
+        return false;
+    }
+    --queuedTasks;
+
+    // the task is counted as finished even if it throws, otherwise wait() would never return
+    struct FinishTask {
+        TaskGroup &group;
+
+        ~FinishTask() { --group.pendingTasks; }
+    } finishTask{*task.second};
+
+    try {
+        task.first();
+    }
+    catch (...) {
+        // the exception is kept for the thread waiting for the group, a worker would be terminated by it
+        std::lock_guard<std::mutex> lock(task.second->errorMutex);
+        if (!task.second->error) {
+            task.second->error = std::current_exception();
+        }
+    }
+    return true;
+}
+
+void ThreadPool::workerLoop(int queue) {
+    currentPool = this;
+    currentPoolQueue = queue;
+
+    while (true) {
+        if (executeTask(queue)) {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        wakeUp.wait(lock, [this] { return stopping || queuedTasks.load() > 0; });
+        if (stopping && queuedTasks.load() == 0) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,87 @@
+#ifndef RAYTRACING_THREADPOOL_H
+#define RAYTRACING_THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Set of tasks which can be waited for together, the first exception thrown by one of them is rethrown by wait()
+class TaskGroup {
+    std::atomic<int> pendingTasks;
+    std::mutex errorMutex;
+    std::exception_ptr error;
+
+    friend class ThreadPool;
+
+public:
+    TaskGroup() : pendingTasks(0) { }
+
+    TaskGroup(const TaskGroup &) = delete;
+
+    TaskGroup &operator=(const TaskGroup &) = delete;
+
+    bool isFinished() const { return pendingTasks.load() == 0; }
+};
+
+// Work-stealing pool: every thread owns a queue, takes its own tasks from the back
+// and steals from the front of the other queues when its own queue is empty.
+// The thread calling wait() takes part in execution, so threadsCount - 1 workers are started.
+class ThreadPool {
+public:
+    typedef std::function<void()> Task;
+
+private:
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<std::pair<Task, TaskGroup *>> tasks;
+    };
+
+    int threadsCount;
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    std::vector<std::thread> workers;
+
+    std::atomic<int> queuedTasks;
+    std::atomic<unsigned> nextQueue;
+    std::mutex sleepMutex;
+    std::condition_variable wakeUp;
+    bool stopping;
+
+    int getCurrentQueue() const;
+
+    bool popTask(int queue, std::pair<Task, TaskGroup *> &task);
+
+    bool stealTask(int queue, std::pair<Task, TaskGroup *> &task);
+
+    bool executeTask(int queue);
+
+    void workerLoop(int queue);
+
+public:
+    // threadsCount == 0 means one thread per hardware core
+    explicit ThreadPool(int threadsCount = 0);
+
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    int getThreadsCount() const { return threadsCount; }
+
+    void run(TaskGroup &group, Task task);
+
+    // Executes tasks until the group is finished, then rethrows the first exception of its tasks if any.
+    // The other tasks of the group still run, so none of them outlives the caller's frame.
+    void wait(TaskGroup &group);
+
+    static int getHardwareThreadsCount();
+};
+
+
+#endif //RAYTRACING_THREADPOOL_H
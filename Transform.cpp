@@ -0,0 +1,55 @@
+#include <cmath>
+#include <stdexcept>
+
+#include "Transform.h"
+
+Transform Transform::translate(const Vector &offset) {
+    return Transform(Vector(1, 0, 0), Vector(0, 1, 0), Vector(0, 0, 1), offset);
+}
+
+Transform Transform::scale(const Vector &factors) {
+    return Transform(Vector(factors.getX(), 0, 0), Vector(0, factors.getY(), 0), Vector(0, 0, factors.getZ()),
+                     Vector(0, 0, 0));
+}
+
+// Rodrigues' rotation formula: cos * v + sin * (k * v) + (1 - cos) * (k % v) * k
+Transform Transform::rotate(const Vector &axis, Real angle) {
+    Vector k = axis.normalise();
+    Real cos = std::cos(angle), sin = std::sin(angle);
+    Vector cross[3] = {Vector(0, -k.getZ(), k.getY()), Vector(k.getZ(), 0, -k.getX()),
+                       Vector(-k.getY(), k.getX(), 0)};
+
+    Vector rotated[3];
+    for (int i = 0; i < 3; ++i) {
+        Vector identityRow(i == 0, i == 1, i == 2);
+        rotated[i] = identityRow * cos + cross[i] * sin + k * (k.getCoordinate(i) * (1 - cos));
+    }
+    return Transform(rotated[0], rotated[1], rotated[2], Vector(0, 0, 0));
+}
+
+Transform Transform::operator*(const Transform &other) const {
+    Vector product[3];
+    for (int i = 0; i < 3; ++i) {
+        product[i] = other.rows[0] * rows[i].getX() + other.rows[1] * rows[i].getY() +
+                     other.rows[2] * rows[i].getZ();
+    }
+    return Transform(product[0], product[1], product[2], transformPoint(other.translation));
+}
+
+// the columns of the inverse are the cross products of the rows divided by the determinant
+Transform Transform::getInverse() const {
+    Vector columns[3] = {rows[1] * rows[2], rows[2] * rows[0], rows[0] * rows[1]};
+    Real determinant = rows[0] % columns[0];
+    if (std::abs(determinant) < 1e-12) {
+        throw std::runtime_error("degenerate transform");
+    }
+
+    Vector inverseRows[3];
+    for (int i = 0; i < 3; ++i) {
+        inverseRows[i] = Vector(columns[0].getCoordinate(i), columns[1].getCoordinate(i),
+                                columns[2].getCoordinate(i)) * (1 / determinant);
+    }
+    Transform inverse(inverseRows[0], inverseRows[1], inverseRows[2], Vector(0, 0, 0));
+    inverse.translation = inverse.transformVector(translation) * -1;
+    return inverse;
+}
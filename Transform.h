@@ -0,0 +1,47 @@
+#ifndef RAYTRACING_TRANSFORM_H
+#define RAYTRACING_TRANSFORM_H
+
+#include "Vector.h"
+
+// Affine transform: the linear part kept by rows and the translation added after it
+class Transform {
+    Vector rows[3];
+    Vector translation;
+
+    Transform(const Vector &row0, const Vector &row1, const Vector &row2, const Vector &translation) :
+            rows{row0, row1, row2}, translation(translation) { }
+
+public:
+    // identity
+    Transform() : Transform(Vector(1, 0, 0), Vector(0, 1, 0), Vector(0, 0, 1), Vector(0, 0, 0)) { }
+
+    static Transform translate(const Vector &offset);
+
+    static Transform scale(const Vector &factors);
+
+    // right-handed rotation around the axis by the angle in radians
+    static Transform rotate(const Vector &axis, Real angle);
+
+    // this transform applied after the other one
+    Transform operator*(const Transform &other) const;
+
+    // throws std::runtime_error if the transform is degenerate
+    Transform getInverse() const;
+
+    Vector transformVector(const Vector &v) const {
+        return Vector(rows[0] % v, rows[1] % v, rows[2] % v);
+    }
+
+    Point transformPoint(const Point &point) const {
+        return transformVector(point) + translation;
+    }
+
+    // Applies the transposed linear part. Normals are moved by the transposed inverse,
+    // so this is called on the inverse transform.
+    Vector transformNormal(const Vector &normal) const {
+        return rows[0] * normal.getX() + rows[1] * normal.getY() + rows[2] * normal.getZ();
+    }
+};
+
+
+#endif //RAYTRACING_TRANSFORM_H
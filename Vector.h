@@ -3,27 +3,46 @@
 
 #include <cmath>
 
+#include "Real.h"
+
+class UnitVector;
+
 class Vector {
-    double x, y, z;
+    Real x, y, z;
 
-    static constexpr double eps = 1e-6;
-    
  public:
+    // tolerance of the geometric comparisons, coarser in single precision
+    static constexpr Real eps = sizeof(Real) < sizeof(double) ? 1e-4 : 1e-6;
+
     Vector() = default;
 
-    Vector(double x, double y, double z) : x(x), y(y), z(z) { }
+    Vector(Real x, Real y, Real z) : x(x), y(y), z(z) { }
 
-    double getX() const { return x; }
+    Real getX() const { return x; }
 
-    double getY() const { return y; }
+    Real getY() const { return y; }
 
-    double getZ() const { return z; }
+    Real getZ() const { return z; }
 
-    void setX(double _x) { x = _x; }
+    void setX(Real _x) { x = _x; }
 
-    void setY(double _y) { y = _y; }
+    void setY(Real _y) { y = _y; }
 
-    void setZ(double _z) { z = _z; }
+    void setZ(Real _z) { z = _z; }
+
+    Real getCoordinate(int axis) const { return axis == 0 ? x : (axis == 1 ? y : z); }
+
+    void setCoordinate(int axis, Real value) {
+        if (axis == 0) {
+            x = value;
+        }
+        else if (axis == 1) {
+            y = value;
+        }
+        else {
+            z = value;
+        }
+    }
 
     Vector operator+(const Vector &v) const {
         return Vector(x + v.x, y + v.y, z + v.z);
@@ -33,15 +52,15 @@ class Vector {
         return Vector(x - v.x, y - v.y, z - v.z);
     }
 
-    friend Vector operator*(double m, const Vector &v) {
+    friend Vector operator*(Real m, const Vector &v) {
         return Vector(m * v.x, m * v.y, m * v.z);
     }
 
-    friend Vector operator*(const Vector &v, double m) {
+    friend Vector operator*(const Vector &v, Real m) {
         return Vector(m * v.x, m * v.y, m * v.z);
     }
 
-    friend double operator%(const Vector &a, const Vector &b) {
+    friend Real operator%(const Vector &a, const Vector &b) {
         return a.x * b.x + a.y * b.y + a.z * b.z;
     }
 
@@ -51,66 +70,88 @@ class Vector {
                       a.x * b.y - a.y * b.x);
     }
 
-    friend double mixedProduct(const Vector &a, const Vector &b, const Vector &c) {
+    friend Real mixedProduct(const Vector &a, const Vector &b, const Vector &c) {
         return a.x * (b.y * c.z - b.z * c.y) + a.y * (b.z * c.x - b.x * c.z) + a.z * (b.x * c.y - b.y * c.x);
     }
 
-    double length() const {
+    Real length() const {
         return std::sqrt(*this % *this);
     }
 
-    double squaredLength() const {
+    Real squaredLength() const {
         return *this % *this;
     }
 
-    Vector normalise(double k = 1) const {
-        return Vector(x * k / length(), y * k / length(), z * k / length());
+    // vector of length k along this one
+    Vector normalise(Real k = 1) const {
+        return *this * (k / length());
     }
 
-    Vector reflect(const Vector &normal) const {
-        return *this - normal.normalise(2 * (*this) % normal);
-    }
+    // the normal has the unit length, so neither of them is normalised
+    Vector reflect(const UnitVector &normal) const;
 
-    Vector refract(const Vector &normal, double n) const {
-        Vector projection = normal.normalise(*this % normal);
-        Vector height = *this - projection;
-        double sin2 = n * sqrt(1 - projection.squaredLength() / this->squaredLength());
-        if (doubleGreaterOrEqual(sin2, 1)) {  // internal reflection
-            return reflect(normal);
-        }
-
-        double cos2 = sqrt(1 - sin2 * sin2);
-        return projection.normalise(cos2) + height.normalise(sin2);
-    }
+    Vector refract(const UnitVector &normal, Real n) const;
 
     Vector putHeight(const Vector &A, const Vector &B) const {
         return A + (B - A).normalise((B - A) % (*this - A) / (B - A).length());
     }
 
-    static bool doubleEqual(double a, double b) {
+    static bool doubleEqual(Real a, Real b) {
         return std::abs(a - b) < eps;
     }
 
-    static bool doubleGreater(double a, double b) {
+    static bool doubleGreater(Real a, Real b) {
         return a > b && !doubleEqual(a, b);
     }
 
-    static bool doubleLess(double a, double b) {
+    static bool doubleLess(Real a, Real b) {
         return a < b && !doubleEqual(a, b);
     }
 
-    static bool doubleLessOrEqual(double a, double b) {
+    static bool doubleLessOrEqual(Real a, Real b) {
         return a < b || doubleEqual(a, b);
     }
 
-    static bool doubleGreaterOrEqual(double a, double b) {
+    static bool doubleGreaterOrEqual(Real a, Real b) {
         return a > b || doubleEqual(a, b);
     }
 };
 
 typedef Vector Point;
 
+// Vector of the unit length, it's only made by normalising, so the operations taking it can skip that
+class UnitVector : public Vector {
+    struct Normalised { };
+
+    UnitVector(const Vector &v, Normalised) : Vector(v) { }
+
+public:
+    UnitVector() = default;
+
+    explicit UnitVector(const Vector &v) : Vector(v.normalise()) { }
+
+    UnitVector operator-() const { return UnitVector(*this * -1, Normalised()); }
+};
+
+inline Vector Vector::reflect(const UnitVector &normal) const {
+    return *this - normal * (2 * (*this % normal));
+}
+
+// The projection on the normal keeps its direction and gets the cosine of the refraction angle as its length,
+// the rest of the ray gets the sine
+inline Vector Vector::refract(const UnitVector &normal, Real n) const {
+    Real normalProjection = *this % normal;
+    Vector height = *this - normal * normalProjection;
+    Real sin2 = n * std::sqrt(1 - normalProjection * normalProjection / squaredLength());
+    if (doubleGreaterOrEqual(sin2, 1)) {  // internal reflection
+        return reflect(normal);
+    }
+
+    Real cos2 = std::sqrt(1 - sin2 * sin2);
+    return normal * std::copysign(cos2, normalProjection) + height.normalise(sin2);
+}
+
 
-double tetrahedronOriendtedVolume(const Point &O, const Point &A, const Point &B, const Point &C);
+Real tetrahedronOriendtedVolume(const Point &O, const Point &A, const Point &B, const Point &C);
 
 #endif //RAYTRACING_VECTOR_H
@@ -0,0 +1,38 @@
+// Qt front end: renders a scene or a model and shows it in a window
+
+#include <iostream>
+#include <stdexcept>
+
+#include <QApplication>
+#include <QLabel>
+#include <QPixmap>
+
+#include "ConvertToQImage.h"
+#include "LoadFromFile.h"
+#include "Render.h"
+
+int main(int argc, char *argv[]) {
+    QApplication application(argc, argv);
+    if (argc != 2) {
+        std::cerr << "usage: " << argv[0] << " <scene.rt | model.stl>\n";
+        return 1;
+    }
+
+    Scene scene;
+    Screen screen;
+    try {
+        LoadFromFile::load(argv[1], scene, screen);
+    }
+    catch (const std::runtime_error &error) {
+        std::cerr << error.what() << "\n";
+        return 1;
+    }
+    scene.buildScene();
+    Render render(&scene, screen, 768, 1024);
+
+    QLabel label;
+    label.setPixmap(QPixmap::fromImage(ConvertToQImage(&render).getQImage()));
+    label.setWindowTitle(argv[1]);
+    label.show();
+    return application.exec();
+}
@@ -1,51 +1,145 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
-#include <QImage>
-#include <QApplication>
-#include <QLabel>
-#include <chrono>
-
 #include "Scene.h"
 #include "Render.h"
-#include "ConvertToQImage.h"
+#include "ImageWriter.h"
 #include "LoadFromStl.h"
 #include "LoadFromRt.h"
+#include "BatchRender.h"
+#include "LoadFromFile.h"
+#include "Statistics.h"
 
 
-void draw(Scene &scene, const Screen &screen, int height, int width, const std::string name) {
-#ifdef COUNT_STATS
-    KDNode::_resetStats();
-#endif
-    std::chrono::steady_clock::time_point buildStart = std::chrono::steady_clock::now();
-    scene.buildScene();
-    std::chrono::steady_clock::time_point buildEnd = std::chrono::steady_clock::now();
+std::atomic<bool> cancelRequested(false);
+// the extension of the saved images, which chooses their format
+std::string imageExtension = ".png";
+// the built trees and the parsed meshes are kept there between the runs, empty disables the cache
+std::string cacheDirectory;
+
+extern "C" void requestCancel(int) {
+    cancelRequested = true;
+}
+
+// Ctrl+C requests the cancellation while it lives, the previous handler is restored even if the rendering throws
+class CancelOnInterrupt {
+    void (*previousHandler)(int);
+
+public:
+    CancelOnInterrupt() : previousHandler(std::signal(SIGINT, requestCancel)) { }
+
+    ~CancelOnInterrupt() {
+        std::signal(SIGINT, previousHandler);
+    }
+
+    CancelOnInterrupt(const CancelOnInterrupt &) = delete;
+
+    CancelOnInterrupt &operator=(const CancelOnInterrupt &) = delete;
+};
+
+void saveImage(const Render &render, const std::string &name) {
+    PhaseTimer timer(Statistics::Encode);
+    ImageWriter::write(name + imageExtension, render);
+}
+
+void printSampling(const Render &render, const std::string &name) {
+    if (render.getSupersampledPixelsCount() > 0) {
+        std::cerr << name << " anti-aliasing: " << render.getSupersampledPixelsCount() << " pixels supersampled, " <<
+        render.getSamplesPerPixel() << " samples per pixel\n";
+    }
+}
+
+// The image is saved after every pass, so the preview can be looked at while the rest is traced.
+// Ctrl+C stops the rendering and keeps the last saved image, the inputs after it aren't rendered.
+void drawProgressive(const Scene &scene, const Screen &screen, int height, int width, const std::string &name,
+                     RenderSettings settings) {
+    settings.cancelFlag = &cancelRequested;
+    CancelOnInterrupt cancelOnInterrupt;
 
     std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
-    Render render(&scene, screen, height, width);
-    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    Render render(&scene, screen, height, width, settings, [&name, start](const Render &render, int step) {
+        saveImage(render, name);
+        std::cerr << name << " step " << step << " pass time: " <<
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count() << "\n";
+        if (step == 1) {
+            printSampling(render, name);
+        }
+        return true;
+    });
+
+    if (render.isCancelled()) {
+        std::cerr << name << " cancelled\n";
+    }
+}
 
-    QImage image = ConvertToQImage(&render).getQImage();
-    image.save(QString::fromStdString(name) + ".png");
+// Builds the scene once and renders a view for every name, a single view is rendered progressively
+// if settings.previewStep is above 1
+void drawViews(Scene &scene, const std::vector<Screen> &screens, int height, int width,
+               const std::vector<std::string> &names, const RenderSettings &settings = RenderSettings()) {
+    std::chrono::steady_clock::time_point buildStart = std::chrono::steady_clock::now();
+    KDTreeSettings treeSettings;
+    treeSettings.cacheDirectory = cacheDirectory;
+    scene.buildScene(treeSettings);
+    std::chrono::steady_clock::time_point buildEnd = std::chrono::steady_clock::now();
 
+    const std::string &name = names.front();
     std::cerr << name << " build time: " <<
     std::chrono::duration_cast<std::chrono::milliseconds>(buildEnd - buildStart).count() << "\n";
-    std::cerr << name << " time: " <<
-    std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "\n";
-#ifdef COUNT_STATS
-    std::cerr << "build calls: " << KDNode::_getBuildCalls() << "\n";
-    std::cerr << "find calls: " << KDNode::_getFindCalls() <<
-    " (" << KDNode::_getFindCalls() * 1.0 / (height * width) << " per pix)" << "\n\n";
-#endif
+
+    if (screens.size() == 1 && settings.previewStep > 1) {
+        drawProgressive(scene, screens.front(), height, width, name, settings);
+    }
+    else {
+        // the images are saved while the next view is traced
+        BatchRender::render(scene, screens, height, width, [&names](size_t frame, const Render &render,
+                                                                    double seconds) {
+            saveImage(render, names[frame]);
+            std::cerr << names[frame] << " time: " << static_cast<long>(seconds * 1000) << "\n";
+            printSampling(render, names[frame]);
+        }, settings);
+    }
+
+    const KDTreeStats &treeStats = scene.getTreeStats();
+    std::cerr << name << " tree" << (treeStats.isCached ? " (cached)" : "") << ": " << treeStats.nodesCount <<
+    " nodes, " << treeStats.leavesCount << " leaves (" << treeStats.emptyLeavesCount << " empty), depth " <<
+    treeStats.maxDepth << ", leaf occupancy " << treeStats.getLeafOccupancy() <<
+    ", duplication " << treeStats.getDuplicationFactor() << "\n";
+    const ArenaStats &allocationStats = scene.getAllocationStats();
+    std::cerr << name << " objects: " << allocationStats.objectsCount << " in " << allocationStats.blocksCount <<
+    " allocations, " << allocationStats.bytesUsed << " of " << allocationStats.bytesReserved << " bytes\n";
+
+    // the counts of the scene include its loading, the next scene starts from zero
+    if (Statistics::isEnabled()) {
+        Statistics::report(std::cerr);
+        Statistics::reset();
+    }
+}
+
+void draw(Scene &scene, const Screen &screen, int height, int width, const std::string name) {
+    drawViews(scene, {screen}, height, width, {name});
 }
 
 
+void loadStl(const std::string &filePath, const Material &material, Scene &scene) {
+    StlLoadStats stats = LoadFromStl::load(filePath, material, scene, cacheDirectory);
+    std::cerr << filePath << ": " << stats.facetsCount << " facets (" << (stats.isBinary ? "binary" : "ASCII") <<
+    (stats.isCached ? ", cached" : "") << "), " << stats.bytesCount / 1e6 << " MB in " << stats.seconds * 1000 <<
+    " ms, " << stats.getThroughput() << " MB/s\n";
+}
+
 void drawTriangle1() {
     std::string caseName = __FUNCTION__;
 
     Scene scene;
-    scene.addObject(new Triangle(Point(0, 0, 0), Point(1, 0, 0), Point(0, 1, 0), Material(Color(1, 0, 0), 0, 0)));
+    scene.createObject<Triangle>(Point(0, 0, 0), Point(1, 0, 0), Point(0, 1, 0), Material(Color(1, 0, 0), 0, 0));
     scene.addLightSource(LightSource(Point(1, 1, 1), 1));
 
     draw(scene, Screen(Point(-4.0 / 3, -1, 1), Vector(8.0 / 3, 0, 0), Vector(0, 2, 0)), 600, 800, caseName);
@@ -55,7 +149,7 @@ void drawTriangle2() {
     std::string caseName = __FUNCTION__;
 
     Scene scene;
-    LoadFromStl::load(std::string("../models/triangle.stl"), Material(Color(0.5, 0, 0), 0, 0), scene);
+    loadStl("../models/triangle.stl", Material(Color(0.5, 0, 0), 0, 0), scene);
     scene.addLightSource(LightSource(Point(2, 2, 2), 10));
 
     draw(scene, Screen(Point(-4.0 / 3, -1, 5), Vector(8.0 / 3, 0, 0), Vector(0, 2, 0)), 600, 800, caseName);
@@ -71,7 +165,7 @@ void drawPolygon1() {
             Point(1, -2, 0),
             Point(1, 0, 0)
     };
-    scene.addObject(new Polygon(vertices, Material(Color(1, 0, 0), 0, 0)));
+    scene.createObject<Polygon>(vertices, Material(Color(1, 0, 0), 0, 0));
     scene.addLightSource(LightSource(Point(1, 1, 1), 1.5));
 
     draw(scene, Screen(Point(-4.0 / 3, -1.7, 3), Vector(8.0 / 3, 0, 0), Vector(0, 2, 0)), 600, 800, caseName);
@@ -81,7 +175,7 @@ void drawSphere1() {
     std::string caseName = __FUNCTION__;
 
     Scene scene;
-    scene.addObject(new Sphere(Point(0, 0, 0), 0.7, Material(Color(0, 1, 0), 0, 0)));
+    scene.createObject<Sphere>(Point(0, 0, 0), 0.7, Material(Color(0, 1, 0), 0, 0));
     scene.addLightSource(LightSource(Point(1, 1, 1), 1));
 
     draw(scene, Screen(Point(-4.0 / 3, -1, 1), Vector(8.0 / 3, 0, 0), Vector(0, 2, 0)), 600, 800, caseName);
@@ -91,8 +185,8 @@ void drawSphereAndTriangle1() {
     std::string caseName = __FUNCTION__;
 
     Scene scene;
-    scene.addObject(new Sphere(Point(0, 0, 0), 0.7, Material(Color(0, 1, 0), 0, 0)));
-    scene.addObject(new Triangle(Point(0, 0, 0.4), Point(1, 0, 0.4), Point(0, 1, 0.4), Material(Color(1, 0, 0), 0, 0)));
+    scene.createObject<Sphere>(Point(0, 0, 0), 0.7, Material(Color(0, 1, 0), 0, 0));
+    scene.createObject<Triangle>(Point(0, 0, 0.4), Point(1, 0, 0.4), Point(0, 1, 0.4), Material(Color(1, 0, 0), 0, 0));
     scene.addLightSource(LightSource(Point(-1, -1, 1.5), 1.3));
     scene.addLightSource(LightSource(Point(0.0, 0.0, 5), 3));
 
@@ -103,7 +197,7 @@ void drawGnomeWithBottle1() {
     std::string caseName = __FUNCTION__;
 
     Scene scene;
-    LoadFromStl::load(std::string("../models/gnome.stl"), Material(Color(1, 0, 0), 0, 0), scene);
+    loadStl("../models/gnome.stl", Material(Color(1, 0, 0), 0, 0), scene);
     scene.addLightSource(LightSource(Point(0, 5, 10), 60));
     scene.addLightSource(LightSource(Point(10, 5, 0), 60));
 
@@ -114,7 +208,7 @@ void drawGnomeWithBottle2() {
     std::string caseName = __FUNCTION__;
 
     Scene scene;
-    LoadFromStl::load(std::string("../models/gnome.stl"), Material(Color(1, 0, 0), 0, 0), scene);
+    loadStl("../models/gnome.stl", Material(Color(1, 0, 0), 0, 0), scene);
     scene.addLightSource(LightSource(Point(-10, 10, 0), 60));
     scene.addLightSource(LightSource(Point(10, 5, 0), 60));
     scene.addLightSource(LightSource(Point(-10, 10, 10), 60));
@@ -122,38 +216,27 @@ void drawGnomeWithBottle2() {
     draw(scene, Screen(Point(5, 0, 10.0 / 3), Vector(0, 0, -20.0 / 3), Vector(0, 5, 0)), 600, 800, caseName);
 }
 
-void drawUtahTeapot1() {
-    std::string caseName = __FUNCTION__;
-
-    Scene scene;
-    LoadFromStl::load(std::string("../models/utah_teapot.stl"), Material(Color(1, 0, 0), 0, 0), scene);
-    scene.addLightSource(LightSource(Point(0, 100, 0), 3000));
-    scene.addLightSource(LightSource(Point(0, 0, 100), 3000));
-
-    draw(scene, Screen(Point(-200.0 / 3, -50, 50), Vector(400.0 / 3, 0, 0), Vector(0, 100, 0)), 600, 800, caseName);
-}
-
-void drawUtahTeapot2() {
-    std::string caseName = __FUNCTION__;
-
+void drawUtahTeapot() {
     Scene scene;
-    LoadFromStl::load(std::string("../models/utah_teapot.stl"), Material(Color(1, 0, 0), 0, 0), scene);
+    loadStl("../models/utah_teapot.stl", Material(Color(1, 0, 0), 0, 0), scene);
     scene.addLightSource(LightSource(Point(0, 100, 0), 3000));
     scene.addLightSource(LightSource(Point(0, 0, 100), 3000));
 
-    draw(scene, Screen(Point(200.0 / 3, 50, -50), Vector(-400.0 / 3, 0, 0), Vector(0, 0, 100)), 600, 800, caseName);
+    drawViews(scene, {Screen(Point(-200.0 / 3, -50, 50), Vector(400.0 / 3, 0, 0), Vector(0, 100, 0)),
+                      Screen(Point(200.0 / 3, 50, -50), Vector(-400.0 / 3, 0, 0), Vector(0, 0, 100))},
+              600, 800, {"drawUtahTeapot1", "drawUtahTeapot2"});
 }
 
 void drawMirror1() {
     std::string caseName = __FUNCTION__;
 
     Scene scene;
-    scene.addObject(new Polygon({Point(-1, -1, 1), Point(0, -1, 0), Point(0, 1, 0), Point(-1, 1, 1)},
-                                Material(Color(0, 0, 1), 0.5, 0)));
-//    scene.addObject(new Polygon({Point(0, -10, -10), Point(1, -10, 10), Point(1, 10, 10), Point(0, 10, -10)},
-//                                Color(1, 0, 0), 0.5));
-    scene.addObject(new Polygon({Point(0, -10, 0), Point(1, -10, 10), Point(1, 10, 10), Point(0, 10, 0)},
-                                Material(Color(1, 0, 0), 0.5, 0)));
+    scene.createObject<Polygon>({Point(-1, -1, 1), Point(0, -1, 0), Point(0, 1, 0), Point(-1, 1, 1)},
+                                Material(Color(0, 0, 1), 0.5, 0));
+//    scene.createObject<Polygon>({Point(0, -10, -10), Point(1, -10, 10), Point(1, 10, 10), Point(0, 10, -10)},
+//                                Color(1, 0, 0), 0.5);
+    scene.createObject<Polygon>({Point(0, -10, 0), Point(1, -10, 10), Point(1, 10, 10), Point(0, 10, 0)},
+                                Material(Color(1, 0, 0), 0.5, 0));
     scene.addLightSource(LightSource(Point(0, 0, 100), 100000));
 
     draw(scene, Screen(Point(-4.0 / 3, -1, 3), Vector(8.0 / 3, 0, 0), Vector(0, 2, 0)), 600, 800, caseName);
@@ -163,11 +246,11 @@ void drawMirror2() {
     std::string caseName = __FUNCTION__;
 
     Scene scene;
-    scene.addObject(new Polygon({Point(-1, -1, 1), Point(0, -1, 0), Point(0, 1, 0), Point(-1, 1, 1)},
-                                Material(Color(0, 1, 0), 0.5, 0)));
-    scene.addObject(new Sphere(Point(-1, 0, 0), 1, Material(Color(0, 0, 1), 0.95, 0)));
-    scene.addObject(new Polygon({Point(0, 0, 0), Point(1, 0, 10), Point(1, 10, 10), Point(0, 10, 0)},
-                                Material(Color(1, 0, 0), 0.5, 0)));
+    scene.createObject<Polygon>({Point(-1, -1, 1), Point(0, -1, 0), Point(0, 1, 0), Point(-1, 1, 1)},
+                                Material(Color(0, 1, 0), 0.5, 0));
+    scene.createObject<Sphere>(Point(-1, 0, 0), 1, Material(Color(0, 0, 1), 0.95, 0));
+    scene.createObject<Polygon>({Point(0, 0, 0), Point(1, 0, 10), Point(1, 10, 10), Point(0, 10, 0)},
+                                Material(Color(1, 0, 0), 0.5, 0));
     scene.addLightSource(LightSource(Point(0, 0, 20), 700));
 
     draw(scene, Screen(Point(-4.0 / 3, -1, 5), Vector(8.0 / 3, 0, 0), Vector(0, 2, 0)), 600, 800, caseName);
@@ -177,8 +260,8 @@ void drawMirror3() {
     std::string caseName = __FUNCTION__;
 
     Scene scene;
-    scene.addObject(new Sphere(Point(-2, 0, 0), 1.5, Material(Color(0, 0, 1), 0.8, 0)));
-    scene.addObject(new Sphere(Point(2, 0, 0), 1.5, Material(Color(0, 0, 1), 0.8, 0)));
+    scene.createObject<Sphere>(Point(-2, 0, 0), 1.5, Material(Color(0, 0, 1), 0.8, 0));
+    scene.createObject<Sphere>(Point(2, 0, 0), 1.5, Material(Color(0, 0, 1), 0.8, 0));
     scene.addLightSource(LightSource(Point(0, 0, 20), 500));
 
     draw(scene, Screen(Point(-4.0 / 3, -1, 10), Vector(8.0 / 3, 0, 0), Vector(0, 2, 0)), 600, 800, caseName);
@@ -188,13 +271,13 @@ void drawGnomeWithBottleWithMirrors1() {
     std::string caseName = __FUNCTION__;
 
     Scene scene;
-    LoadFromStl::load(std::string("../models/gnome.stl"), Material(Color(1, 0, 0), 0, 0), scene);
-    scene.addObject(new Polygon({Point(-10, -2, -10), Point(-10, 7, -10), Point(-13, 7, 0), Point(-13, -2, 0)},
-//                                Material(Color(1, 0, 0), 0.0, 0)));
-                                Material(Color(1, 0, 0), 1, 0)));
-    scene.addObject(new Polygon({Point(-13, -2, 0), Point(-13, 7, 0), Point(-10, 7, 10), Point(-10, -2, 10)},
-//                                Material(Color(0, 0, 1), 0.0, 0)));
-                                Material(Color(0, 0, 1), 0.7, 0)));
+    loadStl("../models/gnome.stl", Material(Color(1, 0, 0), 0, 0), scene);
+    scene.createObject<Polygon>({Point(-10, -2, -10), Point(-10, 7, -10), Point(-13, 7, 0), Point(-13, -2, 0)},
+//                                Material(Color(1, 0, 0), 0.0, 0));
+                                Material(Color(1, 0, 0), 1, 0));
+    scene.createObject<Polygon>({Point(-13, -2, 0), Point(-13, 7, 0), Point(-10, 7, 10), Point(-10, -2, 10)},
+//                                Material(Color(0, 0, 1), 0.0, 0));
+                                Material(Color(0, 0, 1), 0.7, 0));
     scene.addLightSource(LightSource(Point(-10, 10, 0), 60));
     scene.addLightSource(LightSource(Point(10, 5, 0), 60));
     scene.addLightSource(LightSource(Point(-10, 10, 10), 60));
@@ -207,11 +290,11 @@ void drawGlass1() {
     std::string caseName = __FUNCTION__;
 
     Scene scene;
-    scene.addObject(new Sphere(Point(0, 0, -3), 1, Material(Color(0, 0, 1), 0, 0)));
-    scene.addObject(new Polygon({Point(-5, 0, 0), Point(-5, -5, 0), Point(5, -5, 0), Point(5, 0, 0)},
-                                Material(Color(0, 1, 0), 0, 0.5)));
-    scene.addObject(new Polygon({Point(-5, 0, -1), Point(-5, -5, -1), Point(5, -5, -1), Point(5, 0, -1)},
-                                Material(Color(0, 1, 0), 0, 0.5)));
+    scene.createObject<Sphere>(Point(0, 0, -3), 1, Material(Color(0, 0, 1), 0, 0));
+    scene.createObject<Polygon>({Point(-5, 0, 0), Point(-5, -5, 0), Point(5, -5, 0), Point(5, 0, 0)},
+                                Material(Color(0, 1, 0), 0, 0.5));
+    scene.createObject<Polygon>({Point(-5, 0, -1), Point(-5, -5, -1), Point(5, -5, -1), Point(5, 0, -1)},
+                                Material(Color(0, 1, 0), 0, 0.5));
     scene.addLightSource(LightSource(Point(0, 20, 20), 700));
 
     draw(scene, Screen(Point(-4.0 / 3, -1, 5), Vector(8.0 / 3, 0, 0), Vector(0, 2, 0)), 600, 800, caseName);
@@ -221,8 +304,8 @@ void drawGlass2() {
     std::string caseName = __FUNCTION__;
 
     Scene scene;
-    scene.addObject(new Sphere(Point(0, 1, -3), 1, Material(Color(0, 0, 1), 0, 0)));
-    scene.addObject(new Sphere(Point(0, 0, -1), 1, Material(Color(0, 0, 1), 0, 0.5)));
+    scene.createObject<Sphere>(Point(0, 1, -3), 1, Material(Color(0, 0, 1), 0, 0));
+    scene.createObject<Sphere>(Point(0, 0, -1), 1, Material(Color(0, 0, 1), 0, 0.5));
     scene.addLightSource(LightSource(Point(0, 20, 20), 700));
 //    scene.addLightSource(LightSource(Point(20, -20, 20), 700));
 
@@ -233,15 +316,15 @@ void drawInternalReflection1() {
     std::string caseName = __FUNCTION__;
 
     Scene scene;
-    scene.addObject(new Polygon({Point(-1, 0, 30), Point(-1, 0, -10), Point(-1, -5, -10), Point(-1, -5, 30)},
-                                Material(Color(0, 1, 0), 0, 0.01)));
-    scene.addObject(new Polygon({Point(1, 0, 30), Point(1, -5, 30), Point(1, -5, -10), Point(1, 0, -10)},
-                                Material(Color(0, 1, 0), 0, 0.01)));
-    scene.addObject(new Polygon({Point(-1, 5, 30), Point(-1, 5, -10), Point(-1, 0, -10), Point(-1, 0, 30)},
-                                Material(Color(0, 1, 0), 0, 0.0)));
-    scene.addObject(new Polygon({Point(1, 5, 30), Point(1, 0, 30), Point(1, 0, -10), Point(1, 5, -10)},
-                                Material(Color(0, 1, 0), 0, 0.0)));
-    scene.addObject(new Sphere(Point(0, 0, -15), 1, Material(Color(0, 0, 1), 0, 0)));
+    scene.createObject<Polygon>({Point(-1, 0, 30), Point(-1, 0, -10), Point(-1, -5, -10), Point(-1, -5, 30)},
+                                Material(Color(0, 1, 0), 0, 0.01));
+    scene.createObject<Polygon>({Point(1, 0, 30), Point(1, -5, 30), Point(1, -5, -10), Point(1, 0, -10)},
+                                Material(Color(0, 1, 0), 0, 0.01));
+    scene.createObject<Polygon>({Point(-1, 5, 30), Point(-1, 5, -10), Point(-1, 0, -10), Point(-1, 0, 30)},
+                                Material(Color(0, 1, 0), 0, 0.0));
+    scene.createObject<Polygon>({Point(1, 5, 30), Point(1, 0, 30), Point(1, 0, -10), Point(1, 5, -10)},
+                                Material(Color(0, 1, 0), 0, 0.0));
+    scene.createObject<Sphere>(Point(0, 0, -15), 1, Material(Color(0, 0, 1), 0, 0));
 
     scene.addLightSource(LightSource(Point(0, 20, 20), 700));
 
@@ -251,12 +334,193 @@ void drawInternalReflection1() {
 void drawRtFile(const std::string &name, const std::string &caseName) {
     Scene scene;
     Screen screen;
-    LoadFromRt::load(std::string(name), scene, screen);
+    LoadFromRt::load(std::string(name), scene, screen, cacheDirectory);
 
     draw(scene, screen, 768, 1024, caseName);
 }
 
+struct CommandLineOptions {
+    CommandLineOptions() : height(768), width(1024), framesCount(0), format("png"), printStats(false) { }
+
+    std::vector<std::string> inputs;
+    int height;
+    int width;
+    int framesCount; // views of a turntable, 0 renders the scene camera only
+    std::string viewsFile; // viewports rendered instead of the scene camera if not empty
+    std::vector<Screen> views; // read from viewsFile before the first input
+    std::string output;
+    std::string format;
+    bool printStats;
+    std::string cacheDirectory;
+    RenderSettings renderSettings;
+};
+
+void printUsage(const char *program) {
+    std::cerr << "usage: " << program << " [options] <scene.rt | model.stl>...\n"
+    "  --size <width>x<height>  image size, 1024x768 by default\n"
+    "  --threads <count>        rendering threads, all cores by default\n"
+    "  --no-packets             trace every primary ray on its own\n"
+    "  --turntable <frames>     render a full turn of the camera around the scene\n"
+    "  --views <file>           render every input from each viewport ... endviewport block of the file\n"
+    "  --output <name>          image name without the extension for a single input,\n"
+    "                           the input file name by default\n"
+    "  --format <format>        png (by default), ppm, or pfm or exr, which keep the float colors\n"
+    "  --preview <step>         save a preview of every <step>-th pixel first and refine it\n"
+    "                           until the image is full, Ctrl+C keeps the last preview\n"
+    "  --antialias <samples>    trace the pixels at edges again with up to <samples> rays, 1 or at least 4\n"
+    "  --stats                  count the traced rays and time the phases of every scene\n"
+    "  --cache-dir <directory>  keep the built trees and the parsed text meshes there and reuse them,\n"
+    "                           the files are never removed, so the directory can be deleted at any time\n"
+    "Without inputs the built-in scenes are rendered from ../models.\n";
+}
+
+// returns false if the arguments are wrong
+bool parseCommandLine(int argc, char *argv[], CommandLineOptions &options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string argument = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (argument == "--size" && hasValue) {
+            if (std::sscanf(argv[++i], "%dx%d", &options.width, &options.height) != 2 ||
+                options.width <= 0 || options.height <= 0) {
+                return false;
+            }
+        }
+        else if (argument == "--threads" && hasValue) {
+            options.renderSettings.threadsCount = std::max(std::atoi(argv[++i]), 0);
+        }
+        else if (argument == "--no-packets") {
+            options.renderSettings.usePackets = false;
+        }
+        else if (argument == "--turntable" && hasValue) {
+            options.framesCount = std::atoi(argv[++i]);
+            if (options.framesCount <= 0) {
+                return false;
+            }
+        }
+        else if (argument == "--views" && hasValue) {
+            options.viewsFile = argv[++i];
+        }
+        else if (argument == "--output" && hasValue) {
+            options.output = argv[++i];
+        }
+        else if (argument == "--format" && hasValue) {
+            options.format = argv[++i];
+            if (options.format != "png" && options.format != "ppm" && options.format != "pfm" &&
+                options.format != "exr") {
+                return false;
+            }
+        }
+        else if (argument == "--preview" && hasValue) {
+            options.renderSettings.previewStep = std::atoi(argv[++i]);
+            if (options.renderSettings.previewStep <= 0) {
+                return false;
+            }
+        }
+        else if (argument == "--antialias" && hasValue) {
+            options.renderSettings.maxSamples = std::atoi(argv[++i]);
+            // 2 and 3 samples would be rounded down to a 1x1 grid, which turns the anti-aliasing off
+            if (options.renderSettings.maxSamples <= 0 ||
+                (options.renderSettings.maxSamples > 1 && options.renderSettings.maxSamples < 4)) {
+                return false;
+            }
+        }
+        else if (argument == "--stats") {
+            options.printStats = true;
+        }
+        else if (argument == "--cache-dir" && hasValue) {
+            options.cacheDirectory = argv[++i];
+        }
+        else if (argument.compare(0, 2, "--") == 0) {
+            return false;
+        }
+        else {
+            options.inputs.push_back(argument);
+        }
+    }
+    // turntable frames and views are rendered in a single pass, and only one of them can replace the camera
+    bool hasViews = !options.viewsFile.empty();
+    if ((options.framesCount > 0 || hasViews) && options.renderSettings.previewStep > 1) {
+        return false;
+    }
+    if (options.framesCount > 0 && hasViews) {
+        return false;
+    }
+    return options.output.empty() || options.inputs.size() == 1;
+}
+
+// file name without the directories and the extension
+std::string getSceneName(const std::string &filePath) {
+    size_t nameBegin = filePath.find_last_of("/\\");
+    nameBegin = nameBegin == std::string::npos ? 0 : nameBegin + 1;
+    size_t nameEnd = filePath.find_last_of('.');
+    if (nameEnd == std::string::npos || nameEnd < nameBegin) {
+        nameEnd = filePath.size();
+    }
+    return filePath.substr(nameBegin, nameEnd - nameBegin);
+}
+
+void drawFile(const std::string &filePath, const CommandLineOptions &options) {
+    Scene scene;
+    Screen screen;
+    LoadFromFile::load(filePath, scene, screen, cacheDirectory);
+
+    std::string name = options.output.empty() ? getSceneName(filePath) : options.output;
+    std::vector<Screen> screens;
+    if (!options.views.empty()) {
+        screens = options.views;
+    }
+    else if (options.framesCount > 0) {
+        // the camera turns around the vertical axis of the screen going through the scene center
+        BoundingBox sceneBox = scene.getBoundingBox();
+        Point center = sceneBox.minCorner + (sceneBox.maxCorner - sceneBox.minCorner) * 0.5;
+        screens = BatchRender::makeTurntable(screen, center, screen.bottomToTop, options.framesCount);
+    }
+    else {
+        drawViews(scene, {screen}, options.height, options.width, {name}, options.renderSettings);
+        return;
+    }
+
+    std::vector<std::string> names;
+    for (size_t frame = 0; frame < screens.size(); ++frame) {
+        char number[16];
+        std::snprintf(number, sizeof(number), "_%03d", static_cast<int>(frame));
+        names.push_back(name + number);
+    }
+    drawViews(scene, screens, options.height, options.width, names, options.renderSettings);
+}
+
 int main(int argc, char *argv[]) {
+    std::cerr << "precision: " << (sizeof(Real) == sizeof(float) ? "float" : "double") << "\n";
+
+    CommandLineOptions options;
+    if (!parseCommandLine(argc, argv, options)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    Statistics::setEnabled(options.printStats);
+    imageExtension = "." + options.format;
+    cacheDirectory = options.cacheDirectory;
+    if (!options.inputs.empty()) {
+        try {
+            if (!options.viewsFile.empty()) {
+                options.views = LoadFromRt::loadViews(options.viewsFile);
+            }
+            for (const std::string &filePath : options.inputs) {
+                if (cancelRequested) {
+                    std::cerr << "cancelled, " << filePath << " and the inputs after it are skipped\n";
+                    break;
+                }
+                drawFile(filePath, options);
+            }
+        }
+        catch (const std::runtime_error &error) {
+            std::cerr << error.what() << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
     drawTriangle1();
     drawTriangle2();
     drawPolygon1();
@@ -264,8 +528,7 @@ int main(int argc, char *argv[]) {
     drawSphereAndTriangle1();
     drawGnomeWithBottle1();
     drawGnomeWithBottle2();
-    drawUtahTeapot1();
-    drawUtahTeapot2();
+    drawUtahTeapot();
     drawMirror1();
     drawMirror2();
     drawMirror3();